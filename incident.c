@@ -4,6 +4,9 @@
 // http://nethack4.org/esolangs/calesyta-2016.tar.gz
 // License: GPL 3
 
+/* The compiled-program cache (cache.c) uses POSIX file mapping. */
+#define _POSIX_C_SOURCE 200809L
+
 #define DIVSUFSORT_API
 
 
@@ -26,6 +29,28 @@ extern "C" {
 #endif
 
 /*- Datatypes -*/
+#if defined(BUILD_DIVSUFSORT64)
+/* The parts of divsufsort64.h that the amalgamation needs: every index
+   becomes 64 bits wide and the library entry points gain a 64 suffix. */
+# ifndef SAIDX64_T
+#  define SAIDX64_T
+typedef int64_t saidx64_t;
+# endif /* SAIDX64_T */
+# ifndef PRIdSAIDX64_T
+#  define PRIdSAIDX64_T PRId64
+# endif /* PRIdSAIDX64_T */
+# define SAIDX_T
+# define saidx_t saidx64_t
+# define PRIdSAIDX_T PRIdSAIDX64_T
+# define divsufsort divsufsort64
+# define divbwt divbwt64
+# define divsufsort_version divsufsort64_version
+# define bw_transform bw_transform64
+# define inverse_bw_transform inverse_bw_transform64
+# define sufcheck sufcheck64
+# define sa_search sa_search64
+# define sa_simplesearch sa_simplesearch64
+#endif /* BUILD_DIVSUFSORT64 */
 #ifndef SAUCHAR_T
 #define SAUCHAR_T
 typedef uint8_t sauchar_t;
@@ -168,50 +193,321 @@ sa_simplesearch(const sauchar_t *T, saidx_t Tsize,
 
 #define INCIDENT_VERSION_STRING "0.1"
 
+/* The longest program (in octets) that this build can index. */
+#if defined(BUILD_DIVSUFSORT64)
+# define SAIDX_MAX INT64_MAX
+#else
+# define SAIDX_MAX INT32_MAX
+#endif
+
 /* parse.c */
-extern saint_t lexical_parse(const sauchar_t *restrict,
-							 saidx_t *restrict, saidx_t);
-extern saidx_t anchor_command(saidx_t *, saidx_t);
+struct parse_options {
+  /* How to build the suffix and LCP arrays. ENGINE_DIVSUFSORT (the default)
+	 sorts with divsufsort, then makes a separate LCP pass; ENGINE_SAIS
+	 induces the LCP array while sorting, saving that pass. ENGINE_BWT builds
+	 neither, finding the commands in a compressed index instead; it needs
+	 about a third less memory, but its search is many times slower than
+	 the LCP scan. */
+  enum { ENGINE_DIVSUFSORT, ENGINE_SAIS, ENGINE_BWT } engine;
+
+  /* How ENGINE_DIVSUFSORT builds the LCP array. LCP_PHI needs no memory
+	 beyond the suffix array and the LCP array itself; LCP_KASAI uses an
+	 extra rank array but fewer passes over memory, and all of them run on
+	 several threads. LCP_DEFAULT picks LCP_KASAI when sorting with more
+	 than one thread, and LCP_PHI otherwise. */
+  enum { LCP_DEFAULT, LCP_PHI, LCP_KASAI } lcp;
+
+  /* The number of threads to sort with, in builds with OpenMP; 0 leaves it
+	 to OpenMP (and thus to OMP_NUM_THREADS). */
+  int threads;
+
+  /* If not NULL, each parse records where its time went here. */
+  struct parse_stats *stats;
+};
+
+/* How long each phase of a parse took, in seconds, and what it found.
+   Phases that an engine doesn't have separately take no time. */
+struct parse_stats {
+  double sort;          /* building the suffix array (and with ENGINE_SAIS
+						   the LCP array, with ENGINE_BWT the whole index; or
+						   in an incremental parse, updating the arrays) */
+  double lcp;           /* building the LCP array */
+  double scan;          /* finding the provisional commands */
+  double resolve;       /* deleting those that overlap */
+  double relabel;       /* numbering the rest, and writing the output */
+  saidx_t provisional;  /* the number of provisional commands */
+};
+
+/* An incidence of a provisional command. */
+struct incidence {
+  saidx_t start;
+  saidx_t length;
+};
+
+extern double parse_clock(void);
+extern saidx_t lexical_parse(const sauchar_t *restrict,
+							 saidx_t *restrict, saidx_t,
+							 const struct parse_options *);
+
+struct parse_context;
+extern struct parse_context *parse_context_new(const struct parse_options *);
+extern void parse_context_free(struct parse_context *);
+extern saidx_t lexical_reparse(struct parse_context *,
+							   const sauchar_t *restrict,
+							   saidx_t *restrict, saidx_t);
 
 /* utils.c */
+#include <stdbool.h>
+
 extern sauchar_t *malloc_slurp_file(const char *, saidx_t *);
+extern const sauchar_t *load_file(const char *, saidx_t *, bool *);
+extern void unload_file(const sauchar_t *, saidx_t, bool);
+
+/* cache.c */
+#include <stddef.h>
+
+/* A program, parsed and linked, ready to run. Unlike in parsed, incidences
+   here are numbered command << 2 | kind, the kind being the incidence's
+   position in its command (so 0 is a push 0, 1 a pop and 2 a push 1), and
+   the interpreter needs no division to take them apart. */
+struct compiled_image {
+  saidx_t inputlen;
+  saidx_t commandcount;
+  saidx_t anchor;
+  saidx_t first_incidence;     /* where to start outside -f mode */
+  const saidx_t *transitions;  /* post_pop0, post_pop1, post_push of each
+								  command, starting from (unused) command 0 */
+  saidx_t entrycount;
+  const saidx_t *entries;      /* where each fragment starts in -f mode */
+  const saidx_t *parsed;       /* lexical_parse's output, or NULL */
+  bool fragmented;
+
+  void *mapping;               /* set if cache_load_image mapped the image */
+  size_t mappinglen;
+};
+
+extern uint64_t image_hash(const sauchar_t *, saidx_t);
+extern char *cache_image_path(const char *, uint64_t, bool);
+extern bool cache_load_image(const char *, uint64_t, const sauchar_t *,
+							 saidx_t, bool, bool, struct compiled_image *);
+extern bool cache_store_image(const char *, uint64_t, const sauchar_t *,
+							  const struct compiled_image *);
+extern void cache_unload_image(struct compiled_image *);
+
+/* sais.c */
+extern saint_t sais_lcp(const sauchar_t *, saidx_t *, saidx_t *, saidx_t);
+
+/* fmindex.c */
+extern saidx_t fmindex_commands(const sauchar_t *, saidx_t *, saidx_t,
+								struct incidence **, struct parse_stats *);
+
+/* libincident.c */
+#include <stdio.h>
+
+struct incident_program;
+
+enum incident_status {
+  INCIDENT_OK,              /* compiled, or ran to the end */
+  INCIDENT_STEP_LIMIT,      /* stopped after maxsteps steps */
+  INCIDENT_MEMORY_LIMIT,    /* stopped as the stacks would outgrow maxmemory */
+  INCIDENT_OUTPUT_STOPPED,  /* stopped as the output buffer was full, or the
+							   write callback returned false */
+  INCIDENT_NO_MEMORY,       /* memory could not be allocated */
+  INCIDENT_PARSE_ERROR,     /* internal error in the parser */
+};
+
+/* How long compiling a program took, in seconds, and what it found. (The
+   phases of the parse go to parse.stats in the options.) */
+struct incident_compile_stats {
+  double parse;             /* or loading the program from the cache */
+  bool cached;
+  double link;
+  double native;            /* generating native code */
+  saidx_t commands;
+};
+
+struct incident_compile_options {
+  bool fragmented;                /* run the fragments, as incident -f does */
+  bool trace;                     /* keep what trace output needs */
+  const char *cachedir;           /* NULL not to cache compiled programs */
+  struct parse_options parse;
+  struct parse_context *context;  /* non-NULL to reparse incrementally */
+  struct incident_compile_stats *stats;  /* NULL not to time compiling */
+  bool interpreted;               /* don't generate native code (x86-64
+									 only) for the program */
+};
+
+/* Where a run's input comes from (read, or the buffer input if read is NULL)
+   and its output goes (likewise write, or output). context is passed to the
+   callbacks. incident_run sets inputused (for the buffer) and outputused
+   (including trace output). */
+struct incident_io {
+  int (*read)(void *context);                /* an octet, or -1 at the end */
+  const sauchar_t *input;
+  size_t inputlen;
+  size_t inputused;
+  bool (*write)(void *context, sauchar_t);   /* false to stop the run */
+  sauchar_t *output;
+  size_t outputlen;
+  size_t outputused;
+  void *context;
+};
+
+struct incident_run_options {
+  uint64_t maxsteps;        /* incidences to run before stopping; 0 for no
+							   limit */
+  size_t maxmemory;         /* octets of stack to allocate, beyond what each
+							   stack holds in itself; 0 for no limit */
+  bool trace;               /* write trace output too (if compiled for it) */
+
+  /* How to run the program. INCIDENT_DISPATCH_NATIVE (the default) runs
+	 the native code that incident_compile generated for it, if it did;
+	 otherwise, or with INCIDENT_DISPATCH_THREADED, the interpreter jumps
+	 from the end of each kind of incidence's code straight to the next
+	 incidence's, with GCC's labels as values; INCIDENT_DISPATCH_SWITCH runs
+	 every step through one switch. Compilers without labels as values, and
+	 trace output, always use the switch. */
+  enum {
+	INCIDENT_DISPATCH_NATIVE,
+	INCIDENT_DISPATCH_THREADED,
+	INCIDENT_DISPATCH_SWITCH,
+  } dispatch;
+};
+
+/* What a run did. */
+struct incident_counts {
+  uint64_t steps;           /* incidences executed, */
+  uint64_t pushes;          /* of which pushes, */
+  uint64_t pops;            /* pops, */
+  uint64_t skips;           /* and skipped pushes */
+  uint64_t bytesread;
+  uint64_t byteswritten;    /* (not counting trace output) */
+};
+
+extern struct incident_program *
+incident_compile(const sauchar_t *, saidx_t,
+				 const struct incident_compile_options *,
+				 enum incident_status *);
+extern enum incident_status
+incident_run(const struct incident_program *, struct incident_io *,
+			 const struct incident_run_options *, struct incident_counts *);
+extern void incident_free(struct incident_program *);
+extern enum incident_status
+incident_emit_c(const struct incident_program *, FILE *);
 
 /*** End of inlined file: incident.h ***/
 
 
-/*** Start of inlined file: incident.c ***/
+/*** Start of inlined file: libincident.c ***/
 //#include "incident.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-struct command {
-  /* The next incidence after each of the following happens: */
-  saidx_t post_pop0;
-  saidx_t post_pop1;
-  saidx_t post_push;
-
-  /* Intrusive list of skipped commands. (0 means not skipped.) */
-  saidx_t next_skipped_after_push0;
-  saidx_t next_skipped_after_push1;
+/* The interpreter, as a library: incident_compile parses and links a program
+   into a struct incident_program, which incident_run then runs, with
+   whatever I/O and limits the caller gives it. A compiled program isn't
+   changed by running it; everything a run changes (the commands' stacks and
+   lists of skipped incidences) is allocated by that run, and there is no
+   global state, so any number of threads can run one program at once. */
+
+/* How many elements a command's stack holds in itself, before it needs
+   any memory allocating. Most commands never hold more than a few dozen. */
+#define STACK_INLINE_LENGTH 128
+
+/* A command's stack, in a run. */
+struct stack {
+  saidx_t height;         /* total number of elements */
+  saidx_t alloclen;       /* allocated length of bits, in elements */
+  sauchar_t *bits;        /* bottom of stack is LSB of first element; this
+							 is inline_bits until the stack outgrows it */
+  sauchar_t inline_bits[STACK_INLINE_LENGTH / 8];
+};
 
-  /* This command's stack. */
-  saidx_t stack_height;   /* total number of elements */
-  saidx_t stack_alloclen; /* allocated length of stack, in elements */
-  sauchar_t *stack;       /* bottom of stack is LSB of first element */
+/* The kinds of incidence (which are their positions in their commands, and
+   the low two bits of their numbers), and the flag for the pushes that output
+   a bit. An incidence's flags are its kind and INCIDENCE_OUTPUT if it has
+   it, or INCIDENCE_HALT for command 0's (where a run ends): so they pick
+   its code in the threaded interpreter. */
+enum {
+  INCIDENCE_PUSH0,
+  INCIDENCE_POP,
+  INCIDENCE_PUSH1,
+  INCIDENCE_KIND = 3,
+  INCIDENCE_OUTPUT = 4,
+  INCIDENCE_HALT = 8,
 };
 
-struct tracedetails {
-  saidx_t inputlen;
-  saidx_t *parsed;
+/* The number of an incidence, given its value in parsed (which must be above
+   2): see struct compiled_image. */
+static inline saidx_t
+image_incidence(saidx_t parsedvalue)
+{
+  return parsedvalue / 3 << 2 | parsedvalue % 3;
+}
+
+struct incident_program {
+  struct compiled_image image;
+  saidx_t *parsed;        /* the buffers the image points into, unless it */
+  saidx_t *transitions;   /* was loaded from the cache */
+  saidx_t *entries;
+
+  /* The program in the form the interpreter runs: for each incidence (by
+	 its number in the image, so with an unused slot of kind 3 after each
+	 command's), the next incidence after its command pops 0, pops 1 or
+	 pushes, and its flags, each in an array of its own (so that a step reads
+	 only what it needs). */
+  saidx_t *onpop0;
+  saidx_t *onpop1;
+  saidx_t *onpush;
+  sauchar_t *flags;
+
+  struct native_code *native;  /* NULL if there's no native code */
 };
 
-static char *stack_height_2_encodings[] = { u8"⇇", u8"⇆", u8"⇄", u8"⇉" };
+/* Reads an octet of input for a run, returning -1 at the end. */
+static int
+run_read(struct incident_io *io)
+{
+  if (io->read)
+	return io->read(io->context);
+  return io->inputused < io->inputlen ? io->input[io->inputused++] : -1;
+}
+
+/* Writes an octet of output for a run, returning false if it can't. */
+static bool
+run_write(struct incident_io *io, sauchar_t octet)
+{
+  if (io->write) {
+	if (!io->write(io->context, octet))
+	  return false;
+  } else if (io->outputused < io->outputlen) {
+	io->output[io->outputused] = octet;
+  } else {
+	return false;
+  }
+  io->outputused++;
+  return true;
+}
+
+static bool
+run_puts(struct incident_io *io, const char *s)
+{
+  for (; *s; s++)
+	if (!run_write(io, *s))
+	  return false;
+  return true;
+}
+
+static const char *const stack_height_2_encodings[] = {
+  u8"⇇", u8"⇆", u8"⇄", u8"⇉"
+};
 
-static char *
-encode_stack(saidx_t stack_height, sauchar_t *stack)
+static const char *
+encode_stack(saidx_t stack_height, const sauchar_t *stack)
 {
   if (stack_height == 0)
 	return u8" ";
@@ -223,19 +519,92 @@ encode_stack(saidx_t stack_height, sauchar_t *stack)
 		   (1 << ((stack_height - 1) % 8))) ? u8"↰" : u8"↱";
 }
 
-static void
-execute_commands_from(struct command *commands, saidx_t commandcount,
-					  saidx_t first_incidence, saidx_t anchor,
-					  struct tracedetails *trace)
+/* The state of a run. */
+struct run {
+  struct incident_io *io;
+  const struct incident_run_options *options;
+  struct stack *stacks;    /* of each command */
+  saidx_t *skipped;        /* intrusive list of skipped pushes, through the
+							  incidences (0 means not skipped) */
+  uint64_t steps;          /* taken so far, over all fragments */
+  size_t memory;           /* allocated for stacks so far */
+  bool native;             /* run by native_run */
+  bool threaded;           /* or by execute_threaded */
+};
+
+/* Writes a line of trace output: the state of each incidence. */
+static bool
+trace_state(const struct compiled_image *image, const struct run *run,
+			saidx_t ip)
 {
-  /* First, zero all command storage. */
-  for (saidx_t i = 1; i <= commandcount; i++) {
-	commands[i].next_skipped_after_push0 = 0;
-	commands[i].next_skipped_after_push1 = 0;
-	commands[i].stack_height = 0;
-	commands[i].stack_alloclen = 0;
-	commands[i].stack = NULL;
+  for (saidx_t i = 0; i < image->inputlen; i++) {
+	saidx_t c = image->parsed[i];
+	saidx_t incidence = c > 2 ? image_incidence(c) : 0;
+	const char *state;
+	if (c <= 2)
+	  state = u8"░";
+	else if (incidence == ip)
+	  state = u8"▶";
+	else if ((incidence & INCIDENCE_KIND) == INCIDENCE_POP)
+	  state = encode_stack(run->stacks[incidence >> 2].height,
+						   run->stacks[incidence >> 2].bits);
+	else
+	  state = !run->skipped[incidence] ? u8"✓" : u8"✗";
+	if (!run_puts(run->io, state))
+	  return false;
   }
+  return true;
+}
+
+/* Makes room on a stack to push a bit (within the run's memory limit),
+   moving it out of its inline bits the first time. */
+static enum incident_status
+grow_stack(struct run *run, struct stack *stack)
+{
+  bool allocated = stack->bits != stack->inline_bits;
+  saidx_t alloclen = (stack->alloclen + 32) * 2;
+  size_t memory = run->memory +
+	(alloclen - (allocated ? stack->alloclen : 0)) / 8;
+  if (run->options->maxmemory && memory > run->options->maxmemory)
+	return INCIDENT_MEMORY_LIMIT;
+  sauchar_t *bits = realloc(allocated ? stack->bits : NULL, alloclen / 8);
+  if (!bits)
+	return INCIDENT_NO_MEMORY;
+  if (!allocated)
+	memcpy(bits, stack->inline_bits, sizeof stack->inline_bits);
+  stack->bits = bits;
+  stack->alloclen = alloclen;
+  run->memory = memory;
+  return INCIDENT_OK;
+}
+
+/* execute_commands_from's loops are each inlined into two copies, one
+   counting for --stats and one not, so that the counting costs nothing
+   without --stats. */
+#ifdef __GNUC__
+# define EXECUTE_INLINE inline __attribute__((always_inline))
+#else
+# define EXECUTE_INLINE inline
+#endif
+
+static EXECUTE_INLINE enum incident_status
+execute_commands(const struct incident_program *program,
+				 saidx_t first_incidence, struct run *run,
+				 struct incident_counts *counts)
+{
+  const struct compiled_image *image = &program->image;
+  const saidx_t *restrict onpop0 = program->onpop0;
+  const saidx_t *restrict onpop1 = program->onpop1;
+  const saidx_t *restrict onpush = program->onpush;
+  const sauchar_t *restrict flags = program->flags;
+  struct stack *restrict stacks = run->stacks;
+  saidx_t *restrict skipped = run->skipped;
+  struct incident_io *io = run->io;
+  bool trace = run->options->trace && image->parsed;
+  uint64_t steps = run->steps;
+  uint64_t maxsteps = run->options->maxsteps ?
+	run->options->maxsteps : UINT64_MAX;
+  enum incident_status status = INCIDENT_OK;
 
   saidx_t first_skipped_incidence = 1;
 
@@ -246,84 +615,94 @@ execute_commands_from(struct command *commands, saidx_t commandcount,
   saidx_t ip = first_incidence;
   goto first_trace;
   while (ip) {
-	struct command *const cmd = &(commands[ip / 3]);
-
-	/* Ensure we have enough room to push a bit, if we're pushing. */
-	if (ip % 3 != 1 && cmd->stack_alloclen <= cmd->stack_height) {
-	  cmd->stack_alloclen += 32;
-	  cmd->stack_alloclen *= 2;
-	  cmd->stack = realloc(cmd->stack, cmd->stack_alloclen / 8);
-	  if (!cmd->stack) {
-		perror("could not allocate memory");
-		exit(71);
-	  }
+	if (steps == maxsteps) {
+	  status = INCIDENT_STEP_LIMIT;
+	  break;
 	}
+	steps++;
+	struct stack *const stack = &stacks[ip >> 2];
 
-	switch (ip % 3) {
-	case 0: /* "push 0" command */
-	  if (cmd->next_skipped_after_push0) {
+	switch (ip & INCIDENCE_KIND) {
+	case INCIDENCE_PUSH0:
+	  if (skipped[ip]) {
 		/* skip the command; we end up at the post-pop0 location */
-		ip = cmd->post_pop0;
+		ip = onpop0[ip];
+		if (counts)
+		  counts->skips++;
 		break;
 	  }
-	  if (ip + 1 == anchor)
+	  if (counts)
+		counts->pushes++;
+	  if (stack->alloclen <= stack->height &&
+		  (status = grow_stack(run, stack)))
+		goto stop;
+	  if (flags[ip] & INCIDENCE_OUTPUT)
 		output_bits++;
 
-	  cmd->stack[cmd->stack_height / 8] &= ~(1 << (cmd->stack_height % 8));
-	  cmd->stack_height++;
-	  cmd->next_skipped_after_push0 = first_skipped_incidence;
+	  stack->bits[stack->height / 8] &= ~(1 << (stack->height % 8));
+	  stack->height++;
+	  skipped[ip] = first_skipped_incidence;
 	  first_skipped_incidence = ip;
-	  ip = cmd->post_push;
+	  ip = onpush[ip];
 	  break;
 
-	case 2: /* "push 1" command */
-	  if (cmd->next_skipped_after_push1) {
+	case INCIDENCE_PUSH1:
+	  if (skipped[ip]) {
 		/* skip the command; we end up at the post-pop1 location */
-		ip = cmd->post_pop1;
+		ip = onpop1[ip];
+		if (counts)
+		  counts->skips++;
 		break;
 	  }
-	  if (ip - 1 == anchor) {
+	  if (counts)
+		counts->pushes++;
+	  if (stack->alloclen <= stack->height &&
+		  (status = grow_stack(run, stack)))
+		goto stop;
+	  if (flags[ip] & INCIDENCE_OUTPUT) {
 		output_byte |= 1 << output_bits;
 		output_bits++;
 	  }
 
-	  cmd->stack[cmd->stack_height / 8] |= (1 << (cmd->stack_height % 8));
-	  cmd->stack_height++;
-	  cmd->next_skipped_after_push1 = first_skipped_incidence;
+	  stack->bits[stack->height / 8] |= (1 << (stack->height % 8));
+	  stack->height++;
+	  skipped[ip] = first_skipped_incidence;
 	  first_skipped_incidence = ip;
-	  ip = cmd->post_push;
+	  ip = onpush[ip];
 	  break;
 
-	case 1: /* "pop" command */
+	case INCIDENCE_POP:
+	  if (counts)
+		counts->pops++;
 
 	  /* Clear the list of skipped incidences. */
 	  while (first_skipped_incidence != 1) {
-		saidx_t *next_skipped = first_skipped_incidence % 3 ?
-		  &(commands[first_skipped_incidence / 3].next_skipped_after_push1) :
-		  &(commands[first_skipped_incidence / 3].next_skipped_after_push0);
-		first_skipped_incidence = *next_skipped;
-		*next_skipped = 0;
+		saidx_t next = skipped[first_skipped_incidence];
+		skipped[first_skipped_incidence] = 0;
+		first_skipped_incidence = next;
 	  }
 
 	  /* If the stack's empty, read user input. */
-	  if (cmd->stack_height == 0) {
+	  if (stack->height == 0) {
 		if (input_bits == 0) {
-		  int c = getchar();
+		  int c = run_read(io);
 		  if (c < 0) {
 			/* if we have no stack elements and input's at EOF, then skip
 			   the pop command */
-			ip = cmd->post_push;
+			ip = onpush[ip];
 			break;
 		  }
 
 		  input_byte = c;
 		  input_bits = 8;
+		  if (counts)
+			counts->bytesread++;
 		}
 
 		if (input_byte & 1)
-		  ip = cmd->post_pop1;
+		  ip = onpop1[ip];
 		else
-		  ip = cmd->post_pop0;
+		  ip = onpop0[ip];
 		input_byte >>= 1;
 		input_bits--;
 
@@ -331,585 +710,5151 @@ execute_commands_from(struct command *commands, saidx_t commandcount,
 	  }
 
 	  /* Pop the stack, and move the IP accordingly. */
-	  cmd->stack_height--;
-	  if (cmd->stack[cmd->stack_height / 8] & (1 << (cmd->stack_height % 8)))
-		ip = cmd->post_pop1;
+	  stack->height--;
+	  if (stack->bits[stack->height / 8] & (1 << (stack->height % 8)))
+		ip = onpop1[ip];
 	  else
-		ip = cmd->post_pop0;
+		ip = onpop0[ip];
 	  break;
 	}
 
   first_trace:
 	if (trace) {
-	  for (saidx_t i = 0; i < trace->inputlen; i++) {
-		saidx_t c = trace->parsed[i];
-		if (c <= 2)
-		  printf("%s", u8"░");
-		else if (c == ip)
-		  printf("%s", u8"▶");
-		else if ((c % 3) == 1)
-		  printf("%s", encode_stack(commands[c / 3].stack_height,
-									commands[c / 3].stack));
-		else
-		  printf("%s", !((c % 3 == 2)
-						 ? commands[c / 3].next_skipped_after_push1
-						 : commands[c / 3].next_skipped_after_push0)
-				 ? u8"✓" : u8"✗");
+	  if (!trace_state(image, run, ip) ||
+		  (output_bits == 8 && !run_write(io, ' '))) {
+		status = INCIDENT_OUTPUT_STOPPED;
+		break;
 	  }
-	  if (output_bits == 8)
-		putchar(' ');
 	}
 
 	if (output_bits == 8) {
-	  putchar(output_byte);
+	  if (!run_write(io, output_byte)) {
+		status = INCIDENT_OUTPUT_STOPPED;
+		break;
+	  }
 	  output_bits = 0;
 	  output_byte = 0;
+	  if (counts)
+		counts->byteswritten++;
 	}
 
-	if (trace) {
-	  putchar('\n');
+	if (trace && !run_write(io, '\n')) {
+	  status = INCIDENT_OUTPUT_STOPPED;
+	  break;
 	}
   }
 
-  /* Deallocate the allocated parts of command storage. */
-  for (saidx_t i = 1; i <= commandcount; i++) {
-	free(commands[i].stack);
-	commands[i].stack = NULL;
-	commands[i].stack_alloclen = 0;
-  }
+stop:
+  if (counts)
+	counts->steps += steps - run->steps;
+  run->steps = steps;
+  return status;
 }
 
-int
-main(int argc, char **argv)
+/* The threaded interpreter (GCC's labels as values, which clang and ICC
+   have too): the same steps as execute_commands, but each kind of incidence
+   has its own code, which ends by jumping straight to the code for the next
+   incidence's flags. Every kind then has its own indirect jump for the CPU
+   to predict, rather than every step sharing the switch's, and command 0's
+   incidences end the run without a test of ip each step. Pushes that output
+   a bit, and pops from the stack and from input, each have their own code
+   too, so that the other steps test for none of them. It counts in locals
+   whether or not counts is NULL, as the native code counts in registers, so
+   that no step tests it. It doesn't trace. */
+#ifdef __GNUC__
+# define THREADED_DISPATCH
+
+static enum incident_status
+execute_threaded(const struct incident_program *program,
+				 saidx_t first_incidence, struct run *run,
+				 struct incident_counts *counts)
 {
-  bool trace = false;
-  bool fragmented = false;
+  static const void *const code[] = {
+	[INCIDENCE_PUSH0] = &&push0,
+	[INCIDENCE_POP] = &&pop,
+	[INCIDENCE_PUSH1] = &&push1,
+	[INCIDENCE_PUSH0 | INCIDENCE_OUTPUT] = &&push0_output,
+	[INCIDENCE_PUSH1 | INCIDENCE_OUTPUT] = &&push1_output,
+	[INCIDENCE_HALT] = &&halt,
+  };
+  const saidx_t *restrict onpop0 = program->onpop0;
+  const saidx_t *restrict onpop1 = program->onpop1;
+  const saidx_t *restrict onpush = program->onpush;
+  const sauchar_t *restrict flags = program->flags;
+  struct stack *restrict stacks = run->stacks;
+  saidx_t *restrict skipped = run->skipped;
+  struct incident_io *io = run->io;
+  uint64_t steps = run->steps;
+  uint64_t maxsteps = run->options->maxsteps ?
+	run->options->maxsteps : UINT64_MAX;
+  enum incident_status status = INCIDENT_OK;
+  struct stack *stack;
+  uint64_t pushes = 0, pops = 0, skips = 0, bytesread = 0, byteswritten = 0;
 
-  while (argc > 1 && *(argv[1]) == '-') {
-	switch (argv[1][1]) {
-	case 't':
-	  trace = true;
-	  break;
-	case 'f':
-	  fragmented = true;
-	  break;
-	case '-':
-	  if (!strcmp(argv[1], "--version")) {
-		puts("incident version " INCIDENT_VERSION_STRING);
-		return 0;
-	  } else if (!strcmp(argv[1], "--")) {
-		argc--;
-		argv++;
-		goto stop_parsing_options;
-	  }
-	  /* otherwise either it's --help or it's unrecognised;
-		 fall through either way */
-	default:
-	usage:
-	  puts("Usage: incident [options] program");
-	  puts("Interprets the given Incident program.");
-	  puts("Available options:");
-	  puts("  -t  Display detailed trace output");
-	  puts("  -f  Debug a program fragment (start at ^, end at $)");
-	  return (argc != 2 || strcmp(argv[1], "--help")) ? 64 : 0;
-	}
-	argc--;
-	argv++;
-  }
-stop_parsing_options:
-  ;
+  saidx_t first_skipped_incidence = 1;
 
-  if (argc != 2)
-	goto usage;
+  sauchar_t input_byte = 0, output_byte = 0;
+  saidx_t input_bits = 0, output_bits = 0;
 
-  saidx_t inputlen = 0;
-  sauchar_t *input = malloc_slurp_file(argv[1], &inputlen);
-  if (!input)
-	return inputlen; /* malloc_slurp_file prints the error message */
+  saidx_t ip = first_incidence;
 
-  /* Lexically parse the input. */
-  saidx_t parsed[inputlen];
-  saint_t commandcount = lexical_parse(input, parsed, inputlen);
-  if (commandcount < 0) {
-	fprintf(stderr, "internal error: cannot parse program");
-	free(input);
-	return 70;
+/* Goes to the code for the incidence at ip. */
+#define DISPATCH() goto *code[flags[ip]]
+
+/* Starts a step (after checking the step limit). */
+#define STEP()								\
+  do {									\
+	if (steps == maxsteps) {						\
+	  status = INCIDENT_STEP_LIMIT;					\
+	  goto halt;							\
+	}									\
+	steps++;								\
+	stack = &stacks[ip >> 2];						\
+  } while (0)
+
+/* A push of bit, which goes to after_push (having already gone to the
+   post-pop location skipped_ip, if it was skipped). */
+#define PUSH(bit, skipped_ip, after_push)				\
+  do {									\
+	STEP();								\
+	if (skipped[ip]) {							\
+	  ip = skipped_ip[ip];						\
+	  skips++;								\
+	  DISPATCH();							\
+	}									\
+	pushes++;								\
+	if (stack->alloclen <= stack->height &&				\
+		(status = grow_stack(run, stack)))				\
+	  goto halt;							\
+	if (bit)								\
+	  stack->bits[stack->height / 8] |= (1 << (stack->height % 8));	\
+	else								\
+	  stack->bits[stack->height / 8] &= ~(1 << (stack->height % 8));	\
+	stack->height++;							\
+	skipped[ip] = first_skipped_incidence;				\
+	first_skipped_incidence = ip;					\
+	ip = onpush[ip];							\
+	after_push;								\
+  } while (0)
+
+  DISPATCH();
+
+push0:
+  PUSH(0, onpop0, DISPATCH());
+
+push1:
+  PUSH(1, onpop1, DISPATCH());
+
+push0_output:
+  PUSH(0, onpop0, goto output);
+
+push1_output:
+  PUSH(1, onpop1, output_byte |= 1 << output_bits; goto output);
+
+output:
+  if (++output_bits < 8)
+	DISPATCH();
+  if (!run_write(io, output_byte)) {
+	status = INCIDENT_OUTPUT_STOPPED;
+	goto halt;
+  }
+  output_bits = 0;
+  output_byte = 0;
+  byteswritten++;
+  DISPATCH();
+
+pop:
+  STEP();
+  pops++;
+
+  /* Clear the list of skipped incidences. */
+  while (first_skipped_incidence != 1) {
+	saidx_t next = skipped[first_skipped_incidence];
+	skipped[first_skipped_incidence] = 0;
+	first_skipped_incidence = next;
   }
 
-  saidx_t anchor = anchor_command(parsed, inputlen);
-
-  /* Populate a list of commands. */
-  struct command commands[commandcount + 1];
-  saidx_t first_incidence = 0;
-  saidx_t *store_next_command_in = &first_incidence;
-  for (saidx_t i = 0; i < inputlen; i++) {
-	if (fragmented && input[i] == '$') {
-	  *store_next_command_in = 0; /* we stop running at $ in fragmented mode */
-	  store_next_command_in = NULL;
-
-	} else if (parsed[i] > 2) {
-	  /* Store the command in the place we designated for it. */
-	  if (store_next_command_in)
-		*store_next_command_in = parsed[i];
+  /* If the stack's empty, read user input. */
+  if (stack->height == 0)
+	goto pop_input;
+
+  /* Pop the stack, and move the IP accordingly. */
+  stack->height--;
+  if (stack->bits[stack->height / 8] & (1 << (stack->height % 8)))
+	ip = onpop1[ip];
+  else
+	ip = onpop0[ip];
+  DISPATCH();
+
+pop_input:
+  if (input_bits == 0) {
+	int c = run_read(io);
+	if (c < 0) {
+	  /* if we have no stack elements and input's at EOF, then skip the pop
+		 command */
+	  ip = onpush[ip];
+	  DISPATCH();
+	}
 
-	  /* Work out where to store the next command. */
-	  switch (parsed[i] % 3) {
-	  case 0: /* enter: push 0; leave: popped 0 */
-		store_next_command_in = &(commands[parsed[i]/3].post_pop0);
-		break;
-	  case 1: /* enter: pop; leave: pushed something */
-		store_next_command_in = &(commands[parsed[i]/3].post_push);
-		break;
-	  case 2: /* enter: push 1; leave: popped 1 */
-		store_next_command_in = &(commands[parsed[i]/3].post_pop1);
-	  }
+	input_byte = c;
+	input_bits = 8;
+	bytesread++;
+  }
 
-	  /* Skip future bytes of the command. */
-	  while (i + 1 < inputlen && parsed[i+1] == parsed[i] &&
-			 (!fragmented || parsed[i+1] != '$'))
-		i++;
-	}
+  if (input_byte & 1)
+	ip = onpop1[ip];
+  else
+	ip = onpop0[ip];
+  input_byte >>= 1;
+  input_bits--;
+  DISPATCH();
+
+#undef PUSH
+#undef STEP
+#undef DISPATCH
+
+halt:
+  if (counts) {
+	counts->steps += steps - run->steps;
+	counts->pushes += pushes;
+	counts->pops += pops;
+	counts->skips += skips;
+	counts->bytesread += bytesread;
+	counts->byteswritten += byteswritten;
   }
+  run->steps = steps;
+  return status;
+}
+#endif
 
-  if (store_next_command_in)
-	*store_next_command_in = 0;
+/* Native code: on x86-64, incident_compile also translates the program into
+   machine code, with a block of code for each incidence. A block has its
+   command's stack and its own skip mark as memory operands at fixed
+   addresses (from the stacks and skipped of the run), and jumps straight to
+   the blocks of the incidences it can go to, so a step is a few
+   instructions with no dispatch at all. What is rare (growing a stack,
+   reading input, writing output, clearing the list of skipped pushes) is
+   done by shared stubs at the start of the code, which call back into C.
+
+   Registers, while it runs: rbx is the run's stacks, r12 its skipped, r13
+   the first skipped incidence, r14 the steps left before maxsteps, r15 the
+   pushes and rbp the pops so far (the other steps being skips).
+
+   The code is generated in two passes, the first only to find its length
+   and where each block starts, so that every jump can be written once the
+   code is mapped. (64-bit builds, meant for programs too large for this,
+   don't have it.) */
+#if defined(__x86_64__) && !defined(BUILD_DIVSUFSORT64)
+# define NATIVE_CODE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The most code to generate for a program (larger ones are interpreted). */
+#define NATIVE_MAX_LENGTH ((size_t)1 << 28)
+
+struct native_code {
+  sauchar_t *code;
+  size_t length;
+  uint32_t *blocks;       /* where each incidence's block starts, by its
+							 number (command 0's being where a run ends) */
+};
 
-  struct tracedetails td = {inputlen, parsed};
-  struct tracedetails *tdp = trace ? &td : NULL;
+/* What the code and the stubs' C functions share, in a run. */
+struct native_state {
+  struct stack *stacks;   /* (these four are read and written by the code, */
+  saidx_t *skipped;       /* at the offsets in native_prologue and */
+  uint64_t remaining;     /* native_epilogue) */
+  uint64_t pushes;
+  uint64_t pops;
+  struct run *run;
+  uint64_t bytesread;
+  uint64_t byteswritten;
+  sauchar_t input_byte, output_byte;
+  saidx_t input_bits, output_bits;
+};
 
-  if (!fragmented)
-	execute_commands_from(commands, commandcount, first_incidence, anchor, tdp);
-  else {
-	for (saidx_t i = 0; i < inputlen; i++) {
-	  if (input[i] == '^') {
-		while (i < inputlen && parsed[i] <= 2)
-		  i++;
-		if (i < inputlen) {
-		  execute_commands_from(commands, commandcount, parsed[i], anchor, tdp);
-		  putchar('\n');
-		}
-	  }
-	}
+/* Called by the stubs: read a bit of input (-1 at the end of input), write
+   a bit of output, and grow a stack, as execute_commands does. The last two
+   return a status, which if not INCIDENT_OK stops the run. */
+static int
+native_read_bit(struct native_state *state)
+{
+  if (state->input_bits == 0) {
+	int c = run_read(state->run->io);
+	if (c < 0)
+	  return -1;
+	state->input_byte = c;
+	state->input_bits = 8;
+	state->bytesread++;
   }
+  int bit = state->input_byte & 1;
+  state->input_byte >>= 1;
+  state->input_bits--;
+  return bit;
+}
 
-  free(input);
-  return 0;
+static int
+native_write_bit(struct native_state *state, int bit)
+{
+  state->output_byte |= bit << state->output_bits;
+  if (++state->output_bits < 8)
+	return INCIDENT_OK;
+  if (!run_write(state->run->io, state->output_byte))
+	return INCIDENT_OUTPUT_STOPPED;
+  state->output_bits = 0;
+  state->output_byte = 0;
+  state->byteswritten++;
+  return INCIDENT_OK;
 }
 
-/*** End of inlined file: incident.c ***/
+static int
+native_grow_stack(struct native_state *state, struct stack *stack)
+{
+  return grow_stack(state->run, stack);
+}
 
+/* The code being generated: code is NULL in the first pass, which only
+   counts its length. */
+struct native_emitter {
+  sauchar_t *code;
+  size_t length;
+  uint32_t *blocks;
+  size_t halt, step_limit, epilogue, stub_exit;   /* where the stubs are */
+  size_t clear_skipped, read_bit, write_bit[2], grow;
+};
 
-/*** Start of inlined file: parse.c ***/
-//#include "incident.h"
+static void
+native_emit(struct native_emitter *e, const char *bytes, size_t length)
+{
+  if (e->code)
+	memcpy(e->code + e->length, bytes, length);
+  e->length += length;
+}
 
-#include <stdio.h>
-#include <stdlib.h>
+/* (Strings of instruction bytes, without their terminating NUL.) */
+#define NATIVE_EMIT(e, bytes) native_emit(e, bytes, sizeof bytes - 1)
 
-/* The general rules of parsing Incident are fairly simple: identify all
-   substrings that appear exactly three times and aren't contained in a larger
-   such substring (provisional commands) and the locations of those substrings
-   within the string (provisional incidences); then whenever two provisional
-   incidences overlap, delete both the corresponding commands from the list of
-   provisional commands to produce a final list of commands.
+static void
+native_emit32(struct native_emitter *e, uint32_t value)
+{
+  char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+  native_emit(e, bytes, 4);
+}
 
-   In order to identify substrings that have exactly three incidences, we first
-   use libdivsufsort to produce a suffix array (which has the property that if
-   you take the first n characters of each suffix in the array, you get a list
-   of n-character substrings of the input in sorted order). Then we create an
-   LCP array (which lists the number of characters that each suffix shares in
-   common with the subsequent suffix). Then we find substrings with exactly
-   three incidences via looking for sequences [a,b,c,d] in the LCP array for
-   which b and c are both larger than both a and d. */
+static void
+native_emit64(struct native_emitter *e, uint64_t value)
+{
+  native_emit32(e, value);
+  native_emit32(e, value >> 32);
+}
 
-struct incidence {
-  saidx_t start;
-  saidx_t length;
-};
+/* Sets the 32-bit displacement of the jump instruction (of length 6) at
+   jump to go to the code being emitted next. */
+static void
+native_patch(struct native_emitter *e, size_t jump)
+{
+  uint32_t displacement = e->length - (jump + 6);
+  if (e->code)
+	memcpy(e->code + jump + 2,
+		   (char[]){displacement, displacement >> 8, displacement >> 16,
+				   displacement >> 24}, 4);
+}
 
-/* Produce an LCP array and suffix array for a given input string.
+/* Emits a jump or call instruction (opcode, then a 32-bit displacement) to
+   the code at target. */
+static void
+native_jump(struct native_emitter *e, const char *opcode, size_t oplength,
+			size_t target)
+{
+  native_emit(e, opcode, oplength);
+  native_emit32(e, target - (e->length + 4));
+}
 
-   The output is written into the arrays at suffixarray and lcparray, which must
-   be pre-allocated to inputlength and inputlength - 1 elements respectively.
+#define NATIVE_JUMP(e, opcode, target) \
+  native_jump(e, opcode, sizeof opcode - 1, target)
 
-   Returns 0 on success, negative on failure. */
-static saint_t
-suffixlcp(const sauchar_t *restrict input, saidx_t *restrict suffixarray,
-		  saidx_t *restrict lcparray, saidx_t inputlength)
+/* Emits a call to a C function: mov rax, function; call rax. */
+static void
+native_call(struct native_emitter *e, uintptr_t function)
 {
-  /* Sanity check: an LCP array requires a nonempty input string because
-	 otherwise it'd have negatively many elements */
-  if (inputlength <= 0)
-	return -3;
+  NATIVE_EMIT(e, "\x48\xB8");
+  native_emit64(e, function);
+  NATIVE_EMIT(e, "\xFF\xD0");
+}
 
-  /* Use divsufsort to produce the suffix array. */
-  saint_t rv = divsufsort(input, suffixarray, inputlength);
-  if (rv < 0)
-	return rv;
+/* Emits the stubs, and the code to start and end a run. The code's entry
+   point (at 0) is called as int f(struct native_state *, void *block),
+   and returns the run's status. */
+static void
+native_emit_stubs(struct native_emitter *e)
+{
+  _Static_assert(offsetof(struct native_state, pops) < 128,
+				 "native_state offsets must fit in 8 bits");
+
+  /* push rbx, rbp, r12, r13, r14, r15; sub rsp, 8; mov [rsp], rdi */
+  NATIVE_EMIT(e, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57"
+			  "\x48\x83\xEC\x08\x48\x89\x3C\x24");
+  NATIVE_EMIT(e, "\x48\x8B\x5F");        /* mov rbx, [rdi + stacks] */
+  native_emit(e, (char[]){offsetof(struct native_state, stacks)}, 1);
+  NATIVE_EMIT(e, "\x4C\x8B\x67");        /* mov r12, [rdi + skipped] */
+  native_emit(e, (char[]){offsetof(struct native_state, skipped)}, 1);
+  NATIVE_EMIT(e, "\x4C\x8B\x77");        /* mov r14, [rdi + remaining] */
+  native_emit(e, (char[]){offsetof(struct native_state, remaining)}, 1);
+  /* mov r13d, 1; xor r15d, r15d; xor ebp, ebp; jmp rsi */
+  NATIVE_EMIT(e, "\x41\xBD\x01\x00\x00\x00\x45\x31\xFF\x31\xED\xFF\xE6");
+
+  /* The end of a run (the blocks of command 0's incidences): xor eax, eax */
+  e->halt = e->length;
+  NATIVE_EMIT(e, "\x31\xC0");
+  NATIVE_JUMP(e, "\xE9", e->epilogue);
+
+  /* Stopping at maxsteps: xor r14d, r14d; mov eax, INCIDENT_STEP_LIMIT */
+  e->step_limit = e->length;
+  NATIVE_EMIT(e, "\x45\x31\xF6\xB8");
+  native_emit32(e, INCIDENT_STEP_LIMIT);
+
+  /* Returning eax: mov rdi, [rsp]; then save r14, r15 and rbp to remaining,
+	 pushes and pops; add rsp, 8; pop the registers pushed; ret */
+  e->epilogue = e->length;
+  NATIVE_EMIT(e, "\x48\x8B\x3C\x24\x4C\x89\x77");
+  native_emit(e, (char[]){offsetof(struct native_state, remaining)}, 1);
+  NATIVE_EMIT(e, "\x4C\x89\x7F");
+  native_emit(e, (char[]){offsetof(struct native_state, pushes)}, 1);
+  NATIVE_EMIT(e, "\x48\x89\x6F");
+  native_emit(e, (char[]){offsetof(struct native_state, pops)}, 1);
+  NATIVE_EMIT(e, "\x48\x83\xC4\x08\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B"
+			  "\xC3");
+
+  /* Returning eax from within a stub: add rsp, 8 (its return address) */
+  e->stub_exit = e->length;
+  NATIVE_EMIT(e, "\x48\x83\xC4\x08");
+  NATIVE_JUMP(e, "\xE9", e->epilogue);
+
+  /* Clearing the list of skipped incidences, through r12 from r13:
+	 mov eax, r13d; loop: mov ecx, [r12 + rax*4];
+	 mov dword [r12 + rax*4], 0; mov eax, ecx; cmp eax, 1; jne loop;
+	 mov r13d, 1; ret */
+  e->clear_skipped = e->length;
+  NATIVE_EMIT(e, "\x44\x89\xE8\x41\x8B\x0C\x84\x41\xC7\x04\x84\x00\x00\x00"
+			  "\x00\x89\xC8\x83\xF8\x01\x75\xED\x41\xBD\x01\x00\x00\x00\xC3");
+
+  /* The stubs that call C (with the stack aligned, and the state as the
+	 first argument): sub rsp, 8; mov rdi, [rsp + 16]; ...; add rsp, 8 */
+  e->read_bit = e->length;
+  NATIVE_EMIT(e, "\x48\x83\xEC\x08\x48\x8B\x7C\x24\x10");
+  native_call(e, (uintptr_t)native_read_bit);
+  NATIVE_EMIT(e, "\x48\x83\xC4\x08\xC3");
+
+  for (int bit = 0; bit < 2; bit++) {
+	e->write_bit[bit] = e->length;
+	NATIVE_EMIT(e, "\x48\x83\xEC\x08\x48\x8B\x7C\x24\x10\xBE");
+	native_emit32(e, bit);                       /* mov esi, bit */
+	native_call(e, (uintptr_t)native_write_bit);
+	/* add rsp, 8; test eax, eax; jnz stub_exit; ret */
+	NATIVE_EMIT(e, "\x48\x83\xC4\x08\x85\xC0");
+	NATIVE_JUMP(e, "\x0F\x85", e->stub_exit);
+	NATIVE_EMIT(e, "\xC3");
+  }
 
-  /* This algorithm is taken from /Linear-Time Longest-Common-Prefix
-	 Computation in Suffix Arrays and its Implications/ (Kasai, Lee, Arimura,
-	 Arikawa, Park 2001), and was converted to C99 by Alex Smith. */
-  saidx_t rank[inputlength];
-  saidx_t h = 0;
+  /* (The stack to grow is in rsi.) */
+  e->grow = e->length;
+  NATIVE_EMIT(e, "\x48\x83\xEC\x08\x48\x8B\x7C\x24\x10");
+  native_call(e, (uintptr_t)native_grow_stack);
+  NATIVE_EMIT(e, "\x48\x83\xC4\x08\x85\xC0");
+  NATIVE_JUMP(e, "\x0F\x85", e->stub_exit);
+  NATIVE_EMIT(e, "\xC3");
+}
 
-  for (saidx_t i = 0; i < inputlength; i++)
-	rank[suffixarray[i]] = i;
+/* Emits the block for a push of bit at ip, in the command whose stack is
+   at offset stack from rbx. */
+static void
+native_emit_push(struct native_emitter *e,
+				 const struct incident_program *program, saidx_t ip,
+				 int bit, uint32_t stack)
+{
+  const saidx_t *skipto = bit ? program->onpop1 : program->onpop0;
+  uint32_t height = stack + offsetof(struct stack, height);
+
+  /* sub r14, 1; jb step_limit */
+  NATIVE_EMIT(e, "\x49\x83\xEE\x01");
+  NATIVE_JUMP(e, "\x0F\x82", e->step_limit);
+
+  /* If it's skipped, go to the post-pop location:
+	 cmp dword [r12 + ip*4], 0; jne */
+  NATIVE_EMIT(e, "\x41\x83\xBC\x24");
+  native_emit32(e, ip * sizeof (saidx_t));
+  NATIVE_EMIT(e, "\x00");
+  NATIVE_JUMP(e, "\x0F\x85", e->blocks[skipto[ip]]);
+
+  NATIVE_EMIT(e, "\x49\xFF\xC7");            /* inc r15 */
+
+  /* Make room to push: mov eax, [rbx + height]; cmp eax, [rbx + alloclen];
+	 jae (after the block) grow */
+  size_t check = e->length;
+  NATIVE_EMIT(e, "\x8B\x83");
+  native_emit32(e, height);
+  NATIVE_EMIT(e, "\x3B\x83");
+  native_emit32(e, stack + offsetof(struct stack, alloclen));
+  size_t jae = e->length;
+  NATIVE_EMIT(e, "\x0F\x83\x00\x00\x00\x00");
+
+  /* mov rdx, [rbx + bits]; mov esi, eax; shr esi, 3; mov ecx, eax;
+	 and ecx, 7; movzx r8d, byte [rdx + rsi]; bts/btr r8d, ecx;
+	 mov [rdx + rsi], r8b; inc eax; mov [rbx + height], eax */
+  NATIVE_EMIT(e, "\x48\x8B\x93");
+  native_emit32(e, stack + offsetof(struct stack, bits));
+  NATIVE_EMIT(e, "\x89\xC6\xC1\xEE\x03\x89\xC1\x83\xE1\x07\x44\x0F\xB6\x04"
+			  "\x32");
+  if (bit)
+	NATIVE_EMIT(e, "\x41\x0F\xAB\xC8");
+  else
+	NATIVE_EMIT(e, "\x41\x0F\xB3\xC8");
+  NATIVE_EMIT(e, "\x44\x88\x04\x32\xFF\xC0\x89\x83");
+  native_emit32(e, height);
+
+  /* Mark it skipped: mov [r12 + ip*4], r13d; mov r13d, ip */
+  NATIVE_EMIT(e, "\x45\x89\xAC\x24");
+  native_emit32(e, ip * sizeof (saidx_t));
+  NATIVE_EMIT(e, "\x41\xBD");
+  native_emit32(e, ip);
+
+  if (program->flags[ip] & INCIDENCE_OUTPUT)
+	NATIVE_JUMP(e, "\xE8", e->write_bit[bit]);               /* call */
+  NATIVE_JUMP(e, "\xE9", e->blocks[program->onpush[ip]]);   /* jmp */
+
+  /* grow: lea rsi, [rbx + stack]; call grow; jmp check */
+  native_patch(e, jae);
+  NATIVE_EMIT(e, "\x48\x8D\xB3");
+  native_emit32(e, stack);
+  NATIVE_JUMP(e, "\xE8", e->grow);
+  NATIVE_JUMP(e, "\xE9", check);
+}
 
-  for (saidx_t i = 0; i < inputlength; i++) {
-	if (rank[i] == 0)
-	  continue;
+/* Emits the block for the pop at ip, in the command whose stack is at
+   offset stack from rbx. */
+static void
+native_emit_pop(struct native_emitter *e,
+				const struct incident_program *program, saidx_t ip,
+				uint32_t stack)
+{
+  uint32_t height = stack + offsetof(struct stack, height);
+  size_t onpop0 = e->blocks[program->onpop0[ip]];
+  size_t onpop1 = e->blocks[program->onpop1[ip]];
+
+  /* sub r14, 1; jb step_limit; inc rbp */
+  NATIVE_EMIT(e, "\x49\x83\xEE\x01");
+  NATIVE_JUMP(e, "\x0F\x82", e->step_limit);
+  NATIVE_EMIT(e, "\x48\xFF\xC5");
+
+  /* Clear the list of skipped incidences, if it isn't empty:
+	 cmp r13d, 1; je +5; call clear_skipped */
+  NATIVE_EMIT(e, "\x41\x83\xFD\x01\x74\x05");
+  NATIVE_JUMP(e, "\xE8", e->clear_skipped);
+
+  /* If the stack's empty, read input:
+	 mov eax, [rbx + height]; test eax, eax; jz (after the block) */
+  NATIVE_EMIT(e, "\x8B\x83");
+  native_emit32(e, height);
+  NATIVE_EMIT(e, "\x85\xC0");
+  size_t jz = e->length;
+  NATIVE_EMIT(e, "\x0F\x84\x00\x00\x00\x00");
+
+  /* Pop the stack: dec eax; mov [rbx + height], eax; mov rdx, [rbx + bits];
+	 mov esi, eax; shr esi, 3; mov ecx, eax; and ecx, 7;
+	 movzx r8d, byte [rdx + rsi]; bt r8d, ecx; jc onpop1; jmp onpop0 */
+  NATIVE_EMIT(e, "\xFF\xC8\x89\x83");
+  native_emit32(e, height);
+  NATIVE_EMIT(e, "\x48\x8B\x93");
+  native_emit32(e, stack + offsetof(struct stack, bits));
+  NATIVE_EMIT(e, "\x89\xC6\xC1\xEE\x03\x89\xC1\x83\xE1\x07\x44\x0F\xB6\x04"
+			  "\x32\x41\x0F\xA3\xC8");
+  NATIVE_JUMP(e, "\x0F\x82", onpop1);
+  NATIVE_JUMP(e, "\xE9", onpop0);
+
+  /* call read_bit; test eax, eax; js onpush; jnz onpop1; jmp onpop0 */
+  native_patch(e, jz);
+  NATIVE_JUMP(e, "\xE8", e->read_bit);
+  NATIVE_EMIT(e, "\x85\xC0");
+  NATIVE_JUMP(e, "\x0F\x88", e->blocks[program->onpush[ip]]);
+  NATIVE_JUMP(e, "\x0F\x85", onpop1);
+  /* (Unless onpop0 is the next block, the push 1 of the same command.) */
+  if (program->onpop0[ip] != ((ip & ~INCIDENCE_KIND) | INCIDENCE_PUSH1))
+	NATIVE_JUMP(e, "\xE9", onpop0);
+}
 
-	saidx_t j = suffixarray[rank[i] - 1];
-	while (i + h < inputlength && j + h < inputlength &&
-		   input[i + h] == input[j + h])
-	  h++;
-	lcparray[rank[i] - 1] = h;
-	if (h > 0)
-	  h--;
+/* Emits all the code for a program (or, if e->code is NULL, finds its
+   length and where its blocks start). */
+static void
+native_emit_program(struct native_emitter *e,
+					const struct incident_program *program)
+{
+  saidx_t commandcount = program->image.commandcount;
+  e->length = 0;
+  native_emit_stubs(e);
+  for (saidx_t ip = 0; ip < 4; ip++)
+	e->blocks[ip] = e->halt;
+  for (saidx_t c = 1; c <= commandcount; c++) {
+	uint32_t stack = c * sizeof (struct stack);
+	saidx_t ip = c << 2;
+	e->blocks[ip | INCIDENCE_PUSH0] = e->length;
+	native_emit_push(e, program, ip | INCIDENCE_PUSH0, 0, stack);
+	e->blocks[ip | INCIDENCE_POP] = e->length;
+	native_emit_pop(e, program, ip | INCIDENCE_POP, stack);
+	e->blocks[ip | INCIDENCE_PUSH1] = e->length;
+	native_emit_push(e, program, ip | INCIDENCE_PUSH1, 1, stack);
+	e->blocks[ip | INCIDENCE_KIND] = e->halt;   /* (unused) */
   }
+}
 
-  return 0;
+static void
+native_free(struct native_code *native)
+{
+  if (!native)
+	return;
+  if (native->code)
+	munmap(native->code, native->length);
+  free(native->blocks);
+  free(native);
 }
 
+/* Generates the native code for a linked program. Returns NULL if it can't
+   (for lack of memory, or as the program is too large, or the system won't
+   map code), when the program is left to the interpreters. */
+static struct native_code *
+native_compile(const struct incident_program *program)
+{
+  saidx_t commandcount = program->image.commandcount;
+  if (commandcount > (saidx_t)(NATIVE_MAX_LENGTH / 256))
+	return NULL;
+  struct native_code *native = calloc(1, sizeof *native);
+  if (!native)
+	return NULL;
+  struct native_emitter e = {
+	.blocks = native->blocks =
+	  calloc((commandcount + 1) * 4, sizeof *native->blocks),
+  };
+  if (!e.blocks)
+	goto fail;
+
+  native_emit_program(&e, program);
+  if (e.length > NATIVE_MAX_LENGTH)
+	goto fail;
+
+  /* (MAP_ANONYMOUS isn't POSIX; a private mapping of /dev/zero is.) */
+  int fd = open("/dev/zero", O_RDWR);
+  if (fd < 0)
+	goto fail;
+  void *code = mmap(NULL, e.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+					0);
+  close(fd);
+  if (code == MAP_FAILED)
+	goto fail;
+  native->code = e.code = code;
+  native->length = e.length;
+  native_emit_program(&e, program);
+  if (mprotect(code, e.length, PROT_READ | PROT_EXEC))
+	goto fail;
+  return native;
+
+fail:
+  native_free(native);
+  return NULL;
+}
+
+/* Runs the native code from first_incidence, as execute_commands would. */
+static enum incident_status
+native_run(const struct native_code *native, saidx_t first_incidence,
+		   struct run *run, struct incident_counts *counts)
+{
+  struct native_state state = {
+	.stacks = run->stacks,
+	.skipped = run->skipped,
+	.remaining = run->options->maxsteps ?
+	  run->options->maxsteps - run->steps : UINT64_MAX,
+	.run = run,
+  };
+  uint64_t remaining = state.remaining;
+  int (*entry)(struct native_state *, void *) =
+	(int (*)(struct native_state *, void *))(void *)native->code;
+  enum incident_status status =
+	entry(&state, native->code + native->blocks[first_incidence]);
+
+  uint64_t steps = remaining - state.remaining;
+  if (counts) {
+	counts->steps += steps;
+	counts->pushes += state.pushes;
+	counts->pops += state.pops;
+	counts->skips += steps - state.pushes - state.pops;
+	counts->bytesread += state.bytesread;
+	counts->byteswritten += state.byteswritten;
+  }
+  run->steps += steps;
+  return status;
+}
+
+#undef NATIVE_JUMP
+#undef NATIVE_EMIT
+#endif
+
+/* Runs a program from first_incidence, counting into counts if non-NULL. */
+static enum incident_status
+execute_commands_from(const struct incident_program *program,
+					  saidx_t first_incidence, struct run *run,
+					  struct incident_counts *counts)
+{
+  saidx_t commandcount = program->image.commandcount;
+
+  /* First, empty all command storage. */
+  for (saidx_t i = 1; i <= commandcount; i++) {
+	run->stacks[i].height = 0;
+	run->stacks[i].alloclen = STACK_INLINE_LENGTH;
+	run->stacks[i].bits = run->stacks[i].inline_bits;
+  }
+  for (saidx_t i = 0; i < (commandcount + 1) << 2; i++)
+	run->skipped[i] = 0;
+
+  enum incident_status status;
+#ifdef NATIVE_CODE
+  if (run->native)
+	status = native_run(program->native, first_incidence, run, counts);
+  else
+#endif
+#ifdef THREADED_DISPATCH
+  if (run->threaded)
+	status = execute_threaded(program, first_incidence, run, counts);
+  else
+#endif
+	status = counts ?
+	  execute_commands(program, first_incidence, run, counts) :
+	  execute_commands(program, first_incidence, run, NULL);
+
+  /* Deallocate the allocated parts of command storage. */
+  for (saidx_t i = 1; i <= commandcount; i++)
+	if (run->stacks[i].bits != run->stacks[i].inline_bits)
+	  free(run->stacks[i].bits);
+  run->memory = 0;
+  return status;
+}
+
+#undef EXECUTE_INLINE
+
+/* Scanning parsed for the incidences. Most of a program is usually outside
+   the commands, and runs of 0, 1 and 2 can be long, so with 32-bit indices
+   on x86 these check 16 elements at a time with SSE2 (which every x86-64
+   CPU has) before finishing one element at a time. */
+#if defined(__SSE2__) && !defined(BUILD_DIVSUFSORT64)
+# define LINK_SSE2
+# include <emmintrin.h>
+#endif
+
+/* Returns the first position in [from, to) at which an incidence starts or
+   continues (parsed is above 2), or to. */
+static saidx_t
+skip_to_incidence(const saidx_t *parsed, saidx_t from, saidx_t to)
+{
+#ifdef LINK_SSE2
+  const __m128i two = _mm_set1_epi32(2);
+  for (; to - from >= 16; from += 16) {
+	const __m128i *block = (const __m128i *)(parsed + from);
+	__m128i above = _mm_or_si128(
+	  _mm_or_si128(_mm_cmpgt_epi32(_mm_loadu_si128(block), two),
+				   _mm_cmpgt_epi32(_mm_loadu_si128(block + 1), two)),
+	  _mm_or_si128(_mm_cmpgt_epi32(_mm_loadu_si128(block + 2), two),
+				   _mm_cmpgt_epi32(_mm_loadu_si128(block + 3), two)));
+	if (_mm_movemask_epi8(above))
+	  break;
+  }
+#endif
+  while (from < to && parsed[from] <= 2)
+	from++;
+  return from;
+}
+
+/* Returns the first position in [from, to) at which parsed isn't value (the
+   end of an incidence), or to. */
+static saidx_t
+skip_incidence(const saidx_t *parsed, saidx_t from, saidx_t to,
+			   saidx_t value)
+{
+#ifdef LINK_SSE2
+  const __m128i same = _mm_set1_epi32(value);
+  for (; to - from >= 16; from += 16) {
+	const __m128i *block = (const __m128i *)(parsed + from);
+	__m128i equal = _mm_and_si128(
+	  _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block), same),
+					_mm_cmpeq_epi32(_mm_loadu_si128(block + 1), same)),
+	  _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block + 2), same),
+					_mm_cmpeq_epi32(_mm_loadu_si128(block + 3), same)));
+	if (_mm_movemask_epi8(equal) != 0xFFFF)
+	  break;
+  }
+#endif
+  while (from < to && parsed[from] == value)
+	from++;
+  return from;
+}
+
+/* Appends value to a growing list of fragment entries. Returns false (having
+   freed the list) if memory could not be allocated. */
+static bool
+add_entry(saidx_t **entries, saidx_t *count, saidx_t *alloc, saidx_t value)
+{
+  if (*count == *alloc) {
+	saidx_t *newentries = realloc(*entries, *alloc * 2 * sizeof *newentries);
+	if (!newentries) {
+	  free(*entries);
+	  return false;
+	}
+	*entries = newentries;
+	*alloc *= 2;
+  }
+  (*entries)[(*count)++] = value;
+  return true;
+}
+
+/* Links a parsed program, filling in image's first_incidence, anchor,
+   transitions, entrycount and entries (its inputlen, commandcount and
+   fragmented must be set already), all in one pass over parsed:
+
+   - where execution goes after each incidence of each command: post_pop0,
+	 post_pop1 and post_push of each command, in transitions (three elements
+	 per command, starting from command 0, all zeroes to start with);
+   - the incidence to start running from outside -f mode;
+   - the anchor command (as the number of its pop incidence), which is the
+	 command with the centremost incidence; every command has three
+	 incidences, so that is the ((3c - 1) / 2)th;
+   - in -f mode, the incidence that each fragment starts at (the first
+	 command after a ^), in an array allocated here and stored in *entries
+	 (for the caller to free).
+
+   This is a pass of its own rather than part of resolve_overlaps's final
+   sweep, which writes parsed: parsed is lexical_parse's (and
+   lexical_reparse's) output whatever happens to it next, and tracing, the
+   cache and the parser tests all read it. That sweep writes each octet at
+   most twice and never reads parsed back, so fusing the two would save one
+   read of parsed, at the cost of tying the parser to the interpreter's
+   tables.
+
+   Returns false if memory could not be allocated. */
+static bool
+link_program(const sauchar_t *input, const saidx_t *parsed,
+			 saidx_t *transitions, saidx_t **entriesp,
+			 struct compiled_image *image)
+{
+  saidx_t inputlen = image->inputlen;
+  bool fragmented = image->fragmented;
+
+  saidx_t first_incidence = 0;
+  saidx_t *store_next_command_in = &first_incidence;
+
+  saidx_t anchor_target = (image->commandcount * 3 - 1) / 2;
+  saidx_t incidences_seen = 0, last_incidence = 0;
+  image->anchor = 0;
+
+  saidx_t entrycount = 0, entryalloc = 16;
+  saidx_t *entries = malloc(entryalloc * sizeof *entries);
+  bool awaiting_entry = false; /* seen a ^, but no command since */
+  if (!entries)
+	return false;
+
+  for (saidx_t i = 0; i < inputlen; ) {
+	/* Skip to the next incidence, or in -f mode to the next ^ or $. */
+	saidx_t next = skip_to_incidence(parsed, i, inputlen);
+	if (fragmented)
+	  while (i < next && input[i] != '^' && input[i] != '$')
+		i++;
+	else
+	  i = next;
+	if (i == inputlen)
+	  break;
+
+	if (fragmented && input[i] == '^')
+	  awaiting_entry = true;
+	if (awaiting_entry && parsed[i] > 2) {
+	  if (!add_entry(&entries, &entrycount, &entryalloc,
+					 image_incidence(parsed[i])))
+		return false;
+	  awaiting_entry = false;
+	}
+
+	if (parsed[i] > 2 && parsed[i] != last_incidence) {
+	  if (incidences_seen++ == anchor_target)
+		image->anchor = (parsed[i] / 3) << 2 | INCIDENCE_POP;
+	  last_incidence = parsed[i];
+	}
+
+	if (fragmented && input[i] == '$') {
+	  /* We stop running at $ in fragmented mode. */
+	  if (store_next_command_in)
+		*store_next_command_in = 0;
+	  store_next_command_in = NULL;
+	  i++;
+	  continue;
+	}
+	if (parsed[i] <= 2) {
+	  i++; /* a ^ outside the commands */
+	  continue;
+	}
+
+	/* Store the command in the place we designated for it. */
+	saidx_t command = parsed[i];
+	saidx_t incidence = image_incidence(command);
+	if (store_next_command_in)
+	  *store_next_command_in = incidence;
+
+	/* Work out where to store the next command. */
+	switch (command % 3) {
+	case 0: /* enter: push 0; leave: popped 0 */
+	  store_next_command_in = &transitions[command/3*3];
+	  break;
+	case 1: /* enter: pop; leave: pushed something */
+	  store_next_command_in = &transitions[command/3*3 + 2];
+	  break;
+	case 2: /* enter: push 1; leave: popped 1 */
+	  store_next_command_in = &transitions[command/3*3 + 1];
+	}
+
+	/* Skip the rest of the command. In -f mode, a ^ within it starts a
+	   fragment at this command, and a $ within it stops the skip (so that
+	   the command runs only as far as the $). */
+	saidx_t end = skip_incidence(parsed, i + 1, inputlen, command);
+	if (!fragmented) {
+	  i = end;
+	  continue;
+	}
+	for (i++; i < end && input[i] != '$'; i++)
+	  if (input[i] == '^' &&
+		  !add_entry(&entries, &entrycount, &entryalloc, incidence))
+		return false;
+  }
+
+  if (store_next_command_in)
+	*store_next_command_in = 0;
+  if (incidences_seen != image->commandcount * 3)
+	abort(); /* every command should have had three incidences */
+
+  image->first_incidence = first_incidence;
+  image->transitions = transitions;
+  image->entrycount = fragmented ? entrycount : 0;
+  image->entries = *entriesp = entries;
+  return true;
+}
+
+/* Frees a compiled program. */
+void
+incident_free(struct incident_program *program)
+{
+  if (!program)
+	return;
+  cache_unload_image(&program->image);
+  free(program->entries);
+  free(program->transitions);
+  free(program->parsed);
+  free(program->onpop0);
+  free(program->flags);
+#ifdef NATIVE_CODE
+  native_free(program->native);
+#endif
+  free(program);
+}
+
+/* Builds the form of a linked program that the interpreter runs (see struct
+   incident_program). Returns false if memory could not be allocated. */
+static bool
+build_execution_table(struct incident_program *program)
+{
+  const struct compiled_image *image = &program->image;
+  saidx_t incidences = (image->commandcount + 1) << 2;
+  saidx_t *next = program->onpop0 = malloc(incidences * 3 * sizeof *next);
+  sauchar_t *flags = program->flags = malloc(incidences);
+  if (!next || !flags)
+	return false;
+  program->onpop1 = next + incidences;
+  program->onpush = next + incidences * 2;
+
+  for (saidx_t ip = 0; ip < incidences; ip++) {
+	const saidx_t *transitions = image->transitions + (ip >> 2) * 3;
+	program->onpop0[ip] = transitions[0];
+	program->onpop1[ip] = transitions[1];
+	program->onpush[ip] = transitions[2];
+	/* The anchor command's pushes (the even kinds) output a bit. */
+	flags[ip] = ip < 4 ? INCIDENCE_HALT : (ip & INCIDENCE_KIND) |
+	  (ip >> 2 == image->anchor >> 2 && !(ip & 1) ? INCIDENCE_OUTPUT : 0);
+  }
+  return true;
+}
+
+/* Generates the native code for a program, unless options say not to, or
+   this build has no native code. */
+static void
+build_native_code(struct incident_program *program,
+				  const struct incident_compile_options *options)
+{
+#ifdef NATIVE_CODE
+  double start = options->stats ? parse_clock() : 0;
+  if (!options->interpreted)
+	program->native = native_compile(program);
+  if (options->stats)
+	options->stats->native = parse_clock() - start;
+#else
+  (void)program;
+  (void)options;
+#endif
+}
+
+/* Compiles a program: parses it (or loads it from the cache), links its
+   commands together, and generates native code for it where it can.
+   options may be NULL to use the defaults.
+
+   Returns the program, or NULL with *status set to INCIDENT_NO_MEMORY or
+   INCIDENT_PARSE_ERROR. */
+struct incident_program *
+incident_compile(const sauchar_t *input, saidx_t inputlen,
+				 const struct incident_compile_options *options,
+				 enum incident_status *status)
+{
+  static const struct incident_compile_options default_options = {0};
+  if (!options)
+	options = &default_options;
+  struct incident_compile_stats *stats = options->stats;
+  double start = stats ? parse_clock() : 0;
+  if (stats)
+	*stats = (struct incident_compile_stats){.cached = true};
+
+  struct incident_program *program = calloc(1, sizeof *program);
+  if (!program) {
+	*status = INCIDENT_NO_MEMORY;
+	return NULL;
+  }
+
+  /* If the program has been compiled before, use the compiled image. */
+  uint64_t hash = 0;
+  char *imagepath = NULL;
+  if (options->cachedir) {
+	hash = image_hash(input, inputlen);
+	imagepath = cache_image_path(options->cachedir, hash,
+								 options->fragmented);
+  }
+  if (imagepath &&
+	  cache_load_image(imagepath, hash, input, inputlen, options->fragmented,
+					   options->trace, &program->image)) {
+	free(imagepath);
+	imagepath = NULL;
+	if (!build_execution_table(program)) {
+	  *status = INCIDENT_NO_MEMORY;
+	  goto fail;
+	}
+	if (stats) {
+	  stats->parse = parse_clock() - start;
+	  stats->commands = program->image.commandcount;
+	}
+	build_native_code(program, options);
+	*status = INCIDENT_OK;
+	return program;
+  }
+  if (stats) {
+	stats->cached = false;
+	start = parse_clock();
+  }
+
+  /* Lexically parse the input. (The program may be many megabytes long, so
+	 everything sized by it lives on the heap.) */
+  saidx_t *parsed = program->parsed =
+	malloc((inputlen ? inputlen : 1) * sizeof *parsed);
+  saidx_t commandcount = !parsed ? -2 : options->context ?
+	lexical_reparse(options->context, input, parsed, inputlen) :
+	lexical_parse(input, parsed, inputlen, &options->parse);
+  if (commandcount < 0) {
+	*status = commandcount == -2 ? INCIDENT_NO_MEMORY : INCIDENT_PARSE_ERROR;
+	goto fail;
+  }
+  if (stats) {
+	stats->parse = parse_clock() - start;
+	stats->commands = commandcount;
+	start = parse_clock();
+  }
+
+  /* Link the commands together, and find the fragments. */
+  program->transitions = calloc((commandcount + 1) * 3,
+								sizeof *program->transitions);
+  program->image = (struct compiled_image){
+	.inputlen = inputlen,
+	.commandcount = commandcount,
+	.parsed = options->trace ? parsed : NULL,
+	.fragmented = options->fragmented,
+  };
+  if (!program->transitions ||
+	  !link_program(input, parsed, program->transitions, &program->entries,
+					&program->image) ||
+	  !build_execution_table(program)) {
+	*status = INCIDENT_NO_MEMORY;
+	goto fail;
+  }
+  if (stats)
+	stats->link = parse_clock() - start;
+  if (imagepath)
+	cache_store_image(imagepath, hash, input, &program->image);
+  free(imagepath);
+
+  /* Only trace output needs parsed after linking. */
+  if (!options->trace) {
+	free(program->parsed);
+	program->parsed = NULL;
+  }
+  build_native_code(program, options);
+  *status = INCIDENT_OK;
+  return program;
+
+fail:
+  free(imagepath);
+  incident_free(program);
+  return NULL;
+}
+
+/* Runs a compiled program (each of its fragments in turn, with a newline
+   after each, if it was compiled with fragmented set), with the given I/O.
+   options may be NULL to use the defaults, and counts NULL not to count.
+   Any number of runs of the same program may happen at once.
+
+   Returns INCIDENT_OK if the program ran to the end, or why it stopped. */
+enum incident_status
+incident_run(const struct incident_program *program, struct incident_io *io,
+			 const struct incident_run_options *options,
+			 struct incident_counts *counts)
+{
+  static const struct incident_run_options default_options = {0};
+  if (!options)
+	options = &default_options;
+  const struct compiled_image *image = &program->image;
+  io->inputused = io->outputused = 0;
+  if (counts)
+	*counts = (struct incident_counts){0};
+
+  /* Everything a run changes is its own. */
+  bool tracing = options->trace && image->parsed;
+  struct run run = {
+	.io = io,
+	.options = options,
+	.stacks = malloc((image->commandcount + 1) * sizeof *run.stacks),
+	.skipped = malloc((image->commandcount + 1) * 4 * sizeof *run.skipped),
+	.native = options->dispatch == INCIDENT_DISPATCH_NATIVE &&
+	  program->native && !tracing,
+	.threaded = options->dispatch != INCIDENT_DISPATCH_SWITCH && !tracing,
+  };
+  if (!run.stacks || !run.skipped) {
+	free(run.skipped);
+	free(run.stacks);
+	return INCIDENT_NO_MEMORY;
+  }
+
+  enum incident_status status = INCIDENT_OK;
+  if (!image->fragmented)
+	status = execute_commands_from(program, image->first_incidence, &run,
+								   counts);
+  else {
+	for (saidx_t i = 0; i < image->entrycount && !status; i++) {
+	  status = execute_commands_from(program, image->entries[i], &run,
+									 counts);
+	  if (!status && !run_write(io, '\n'))
+		status = INCIDENT_OUTPUT_STOPPED;
+	}
+  }
+
+  free(run.skipped);
+  free(run.stacks);
+  return status;
+}
+
+/* The part of the C that incident_emit_c writes that is the same for every
+   program: the interpreter's storage and its operations on it. (skipped is
+   a list of the pushes skipped since the last pop, as in struct run.) */
+static const char emit_c_runtime[] =
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "\n"
+  "/* Each command's stack (bottom of stack is LSB of first element). */\n"
+  "static struct stack {\n"
+  "  size_t height;\n"
+  "  size_t alloclen;\n"
+  "  unsigned char *bits;\n"
+  "} stacks[COMMANDS + 1];\n"
+  "\n"
+  "/* The pushes skipped since the last pop, as a list from first_skipped\n"
+  "   (0 means not skipped; the list ends at 1). */\n"
+  "static long skipped[(COMMANDS + 1) * 4];\n"
+  "static long first_skipped;\n"
+  "\n"
+  "static int input_byte, input_bits, output_byte, output_bits;\n"
+  "\n"
+  "static inline void\n"
+  "write_octet(int octet)\n"
+  "{\n"
+  "  if (putchar(octet) == EOF) {\n"
+  "    perror(\"could not write output\");\n"
+  "    exit(74);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "/* The push at ip, of bit onto stack: returns 0 if it's skipped. */\n"
+  "static inline int\n"
+  "push(long ip, struct stack *stack, int bit)\n"
+  "{\n"
+  "  if (skipped[ip])\n"
+  "    return 0;\n"
+  "  if (stack->alloclen <= stack->height) {\n"
+  "    size_t alloclen = (stack->alloclen + 32) * 2;\n"
+  "    unsigned char *bits = realloc(stack->bits, alloclen / 8);\n"
+  "    if (!bits) {\n"
+  "      perror(\"could not allocate memory\");\n"
+  "      exit(71);\n"
+  "    }\n"
+  "    stack->bits = bits;\n"
+  "    stack->alloclen = alloclen;\n"
+  "  }\n"
+  "  if (bit)\n"
+  "    stack->bits[stack->height / 8] |= 1 << stack->height % 8;\n"
+  "  else\n"
+  "    stack->bits[stack->height / 8] &= ~(1 << stack->height % 8);\n"
+  "  stack->height++;\n"
+  "  skipped[ip] = first_skipped;\n"
+  "  first_skipped = ip;\n"
+  "  return 1;\n"
+  "}\n"
+  "\n"
+  "/* A push by the anchor command, which outputs its bit too. */\n"
+  "static inline int\n"
+  "push_output(long ip, struct stack *stack, int bit)\n"
+  "{\n"
+  "  if (!push(ip, stack, bit))\n"
+  "    return 0;\n"
+  "  output_byte |= bit << output_bits;\n"
+  "  if (++output_bits == 8) {\n"
+  "    write_octet(output_byte);\n"
+  "    output_byte = output_bits = 0;\n"
+  "  }\n"
+  "  return 1;\n"
+  "}\n"
+  "\n"
+  "/* Pops a bit from a stack, or reads one from input if it's empty;\n"
+  "   returns -1 if input has ended too. Either way, no pushes are skipped\n"
+  "   any more. */\n"
+  "static inline int\n"
+  "pop(struct stack *stack)\n"
+  "{\n"
+  "  while (first_skipped != 1) {\n"
+  "    long next = skipped[first_skipped];\n"
+  "    skipped[first_skipped] = 0;\n"
+  "    first_skipped = next;\n"
+  "  }\n"
+  "\n"
+  "  if (stack->height) {\n"
+  "    stack->height--;\n"
+  "    return stack->bits[stack->height / 8] >> stack->height % 8 & 1;\n"
+  "  }\n"
+  "\n"
+  "  if (!input_bits) {\n"
+  "    int c = getchar();\n"
+  "    if (c == EOF)\n"
+  "      return -1;\n"
+  "    input_byte = c;\n"
+  "    input_bits = 8;\n"
+  "  }\n"
+  "  int bit = input_byte & 1;\n"
+  "  input_byte >>= 1;\n"
+  "  input_bits--;\n"
+  "  return bit;\n"
+  "}\n"
+  "\n"
+  "/* Each chunk function runs the program from ip until it goes to an\n"
+  "   incidence outside the chunk, which it returns (0 at the end). */\n";
+
+/* How many incidences incident_emit_c writes into each function. All the
+   incidences could be labels in one function, but compilers take time far
+   worse than linear in the size of a function like that (GCC takes minutes
+   for a thousand commands, at any optimisation level), so they are split
+   into small functions, in an order that mostly keeps each step within its
+   function. */
+#define EMIT_C_CHUNK 256
+
+/* Writes the C for going from the incidence ip to next, in their chunks:
+   a goto within the chunk, or otherwise a return to run. */
+static void
+emit_c_goto(FILE *out, const saidx_t *chunk, saidx_t ip, saidx_t next)
+{
+  if (next < 4)
+	fputs("return 0;\n", out);
+  else if (chunk[next] == chunk[ip])
+	fprintf(out, "goto i%" PRIdSAIDX_T ";\n", next);
+  else
+	fprintf(out, "return %" PRIdSAIDX_T ";\n", next);
+}
+
+/* The incidences that ip can go to: the usual one first, then the one it
+   goes to when skipped (or for a pop, on popping 1, then at the end of
+   input). Returns how many there are. */
+static int
+emit_c_next(const struct incident_program *program, saidx_t ip,
+			saidx_t *next)
+{
+  switch (ip & INCIDENCE_KIND) {
+  case INCIDENCE_PUSH0:
+	next[0] = program->onpush[ip];
+	next[1] = program->onpop0[ip];
+	return 2;
+  case INCIDENCE_PUSH1:
+	next[0] = program->onpush[ip];
+	next[1] = program->onpop1[ip];
+	return 2;
+  default:
+	next[0] = program->onpop0[ip];
+	next[1] = program->onpop1[ip];
+	next[2] = program->onpush[ip];
+	return 3;
+  }
+}
+
+/* Writes a program out as C: a translation unit of its own that runs it as
+   incident does (without trace output), reading standard input and writing
+   standard output, but with no parsing. Each incidence is a label and each
+   step a goto, with a static stack for each command.
+
+   Returns INCIDENT_OK, or INCIDENT_OUTPUT_STOPPED if out could not be
+   written, or INCIDENT_NO_MEMORY. */
+enum incident_status
+incident_emit_c(const struct incident_program *program, FILE *out)
+{
+  const struct compiled_image *image = &program->image;
+  saidx_t incidences = (image->commandcount + 1) << 2;
+  saidx_t entrycount = image->fragmented ? image->entrycount : 1;
+  const saidx_t *entries =
+	image->fragmented ? image->entries : &image->first_incidence;
+
+  /* Only the incidences that can be reached from an entry are written
+	 (others' labels would be unused, and warned about). They are ordered
+	 depth first, following each incidence's usual next incidence first,
+	 and chunked in that order: chunk is each one's chunk, from 1 (0 if it
+	 can't be reached, and -1 while it's pending). entered is set for those
+	 that can be gone to from outside their chunk. */
+  saidx_t *chunk = calloc(incidences, sizeof *chunk);
+  saidx_t *order = malloc(incidences * sizeof *order);
+  saidx_t *pending = malloc(incidences * sizeof *pending);
+  bool *entered = calloc(incidences, sizeof *entered);
+  enum incident_status status = INCIDENT_NO_MEMORY;
+  if (!chunk || !order || !pending || !entered)
+	goto done;
+
+  saidx_t reached = 0, pendingcount = 0;
+  for (saidx_t i = entrycount; i-- > 0;) {
+	if (entries[i] >= 4 && !chunk[entries[i]]) {
+	  chunk[entries[i]] = -1;
+	  pending[pendingcount++] = entries[i];
+	}
+	entered[entries[i]] = true;
+  }
+  while (pendingcount) {
+	saidx_t ip = pending[--pendingcount], next[3];
+	chunk[ip] = reached / EMIT_C_CHUNK + 1;
+	order[reached++] = ip;
+	for (int i = emit_c_next(program, ip, next); i-- > 0;) {
+	  if (next[i] >= 4 && !chunk[next[i]]) {
+		chunk[next[i]] = -1;
+		pending[pendingcount++] = next[i];
+	  }
+	}
+  }
+  for (saidx_t i = 0; i < reached; i++) {
+	saidx_t next[3];
+	for (int j = emit_c_next(program, order[i], next); j-- > 0;)
+	  if (chunk[next[j]] != chunk[order[i]])
+		entered[next[j]] = true;
+  }
+
+  fprintf(out, "/* An Incident program of %" PRIdSAIDX_T " octets, compiled "
+		  "to C by incident --emit-c%s. */\n\n", image->inputlen,
+		  image->fragmented ? " -f" : "");
+  fprintf(out, "#define COMMANDS %" PRIdSAIDX_T "L\n\n", image->commandcount);
+  fputs(emit_c_runtime, out);
+
+  static const char *const kinds[] = {"push 0", "pop", "push 1"};
+  saidx_t chunks = (reached + EMIT_C_CHUNK - 1) / EMIT_C_CHUNK;
+  for (saidx_t c = 0; c < chunks; c++) {
+	saidx_t first = c * EMIT_C_CHUNK;
+	saidx_t last = first + EMIT_C_CHUNK < reached ?
+	  first + EMIT_C_CHUNK : reached;
+	fprintf(out, "\nstatic long\nchunk%" PRIdSAIDX_T "(long ip)\n{\n"
+			"  switch (ip) {\n", c + 1);
+	for (saidx_t i = first; i < last; i++)
+	  if (entered[order[i]])
+		fprintf(out, "  case %" PRIdSAIDX_T ": goto i%" PRIdSAIDX_T ";\n",
+				order[i], order[i]);
+	fputs("  }\n  return 0;\n", out);
+
+	for (saidx_t i = first; i < last; i++) {
+	  saidx_t ip = order[i], command = ip >> 2;
+	  unsigned kind = ip & INCIDENCE_KIND;
+	  fprintf(out, "\ni%" PRIdSAIDX_T ": /* command %" PRIdSAIDX_T ", %s */\n",
+			  ip, command, kinds[kind]);
+	  if (kind == INCIDENCE_POP) {
+		fprintf(out, "  switch (pop(&stacks[%" PRIdSAIDX_T "])) {\n"
+				"  case 0: ", command);
+		emit_c_goto(out, chunk, ip, program->onpop0[ip]);
+		fputs("  case 1: ", out);
+		emit_c_goto(out, chunk, ip, program->onpop1[ip]);
+		fputs("  default: ", out);  /* (at the end of input) */
+		emit_c_goto(out, chunk, ip, program->onpush[ip]);
+		fputs("  }\n", out);
+	  } else {
+		int bit = kind == INCIDENCE_PUSH1;
+		fprintf(out, "  if (%s(%" PRIdSAIDX_T ", &stacks[%" PRIdSAIDX_T
+				"], %d))\n    ",
+				program->flags[ip] & INCIDENCE_OUTPUT ? "push_output" : "push",
+				ip, command, bit);
+		emit_c_goto(out, chunk, ip, program->onpush[ip]);
+		fputs("  ", out);  /* (skipped) */
+		emit_c_goto(out, chunk, ip,
+					bit ? program->onpop1[ip] : program->onpop0[ip]);
+	  }
+	}
+	fputs("}\n", out);
+  }
+
+  /* run, and the tables it goes through to get to each chunk. */
+  fputs("\nstatic long (*const chunks[])(long) = {\n  0,", out);
+  for (saidx_t c = 1; c <= chunks; c++)
+	fprintf(out, c % 8 ? " chunk%" PRIdSAIDX_T "," : "\n  chunk%"
+			PRIdSAIDX_T ",", c);
+  fputs("\n};\n\nstatic const int chunk_of[(COMMANDS + 1) * 4] = {", out);
+  for (saidx_t ip = 0; ip < incidences; ip++)
+	fprintf(out, ip % 16 ? " %" PRIdSAIDX_T "," : "\n  %" PRIdSAIDX_T ",",
+			chunk[ip]);
+  fputs("\n};\n"
+		"\n"
+		"/* Runs the program from the incidence entry, with empty stacks. */\n"
+		"static void\n"
+		"run(long entry)\n"
+		"{\n"
+		"  for (long i = 0; i < (COMMANDS + 1) * 4; i++)\n"
+		"    skipped[i] = 0;\n"
+		"  first_skipped = 1;\n"
+		"  input_byte = input_bits = output_byte = output_bits = 0;\n"
+		"\n"
+		"  for (long ip = entry; ip;)\n"
+		"    ip = chunks[chunk_of[ip]](ip);\n"
+		"\n"
+		"  for (long i = 1; i <= COMMANDS; i++) {\n"
+		"    free(stacks[i].bits);\n"
+		"    stacks[i] = (struct stack){0};\n"
+		"  }\n"
+		"}\n"
+		"\n"
+		"int\n"
+		"main(void)\n"
+		"{\n", out);
+  if (!entrycount)
+	fputs("  (void)run;  /* (the program has no fragments) */\n", out);
+  for (saidx_t i = 0; i < entrycount; i++) {
+	fprintf(out, "  run(%" PRIdSAIDX_T ");\n", entries[i]);
+	if (image->fragmented)
+	  fputs("  write_octet('\\n');\n", out);
+  }
+  fputs("  if (fflush(stdout)) {\n"
+		"    perror(\"could not write output\");\n"
+		"    return 74;\n"
+		"  }\n"
+		"  return 0;\n"
+		"}\n", out);
+  status = fflush(out) || ferror(out) ? INCIDENT_OUTPUT_STOPPED : INCIDENT_OK;
+
+done:
+  free(entered);
+  free(pending);
+  free(order);
+  free(chunk);
+  return status;
+}
+
+/*** End of inlined file: libincident.c ***/
+
+
+/*** Start of inlined file: incident.c ***/
+//#include "incident.h"
+
+/* (The benchmark in bench.c, and the tests in parse.c, replace the
+   interpreter.) */
+#if !defined(BENCHMARK) && !defined(TEST)
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* What --stats reports about a run of a program. */
+struct run_stats {
+  double load;                /* reading the program, in seconds */
+  struct incident_compile_stats compile;
+  struct parse_stats phases;  /* (of the parse) */
+  double execute;             /* running it, in seconds */
+  saidx_t inputlen;
+  struct incident_counts counts;
+};
+
+/* How main has been asked to run programs. */
+struct run_options {
+  bool emit;                  /* write the program as C, not run it */
+  struct incident_run_options run;
+  struct incident_compile_options compile;
+  struct run_stats *stats;    /* non-NULL for --stats */
+};
+
+/* Prints the --stats of a run to standard error. */
+static void
+print_stats(const struct run_stats *stats)
+{
+  const struct incident_compile_stats *compile = &stats->compile;
+  const struct parse_stats *phases = &stats->phases;
+  const struct incident_counts *counts = &stats->counts;
+  fprintf(stderr, "load         %12.6f s\n", stats->load);
+  if (compile->cached) {
+	fprintf(stderr, "parse        %12.6f s  (from the cache)\n",
+			compile->parse);
+  } else {
+	fprintf(stderr, "parse        %12.6f s\n", compile->parse);
+	fprintf(stderr, "  sort       %12.6f s\n", phases->sort);
+	fprintf(stderr, "  lcp        %12.6f s\n", phases->lcp);
+	fprintf(stderr, "  scan       %12.6f s\n", phases->scan);
+	fprintf(stderr, "  resolve    %12.6f s\n", phases->resolve);
+	fprintf(stderr, "  relabel    %12.6f s\n", phases->relabel);
+	fprintf(stderr, "link         %12.6f s\n", compile->link);
+  }
+  fprintf(stderr, "native       %12.6f s\n", compile->native);
+  fprintf(stderr, "execute      %12.6f s\n", stats->execute);
+  fprintf(stderr, "total        %12.6f s\n",
+		  stats->load + compile->parse + compile->link + compile->native +
+		  stats->execute);
+  fprintf(stderr, "program      %12" PRIdSAIDX_T " octets\n", stats->inputlen);
+  if (!compile->cached)
+	fprintf(stderr, "provisional  %12" PRIdSAIDX_T " commands\n",
+			phases->provisional);
+  fprintf(stderr, "commands     %12" PRIdSAIDX_T "\n", compile->commands);
+  fprintf(stderr, "incidences   %12" PRIdSAIDX_T "\n", compile->commands * 3);
+  fprintf(stderr, "steps        %12" PRIu64 "  (%.0f per second)\n",
+		  counts->steps, stats->execute > 0 ? counts->steps / stats->execute
+		  : 0);
+  fprintf(stderr, "  pushes     %12" PRIu64 "\n", counts->pushes);
+  fprintf(stderr, "  pops       %12" PRIu64 "\n", counts->pops);
+  fprintf(stderr, "  skips      %12" PRIu64 "\n", counts->skips);
+  fprintf(stderr, "read         %12" PRIu64 " octets\n", counts->bytesread);
+  fprintf(stderr, "written      %12" PRIu64 " octets\n", counts->byteswritten);
+}
+
+/* The interpreter's I/O is standard input and output. */
+static int
+read_stdin(void *context)
+{
+  (void)context;
+  return getchar();
+}
+
+static bool
+write_stdout(void *context, sauchar_t octet)
+{
+  (void)context;
+  return putchar(octet) != EOF;
+}
+
+/* Compiles (or loads from the cache) and runs a program. Returns an exit
+   status. */
+static int
+run_program(const sauchar_t *input, saidx_t inputlen,
+			const struct run_options *options)
+{
+  struct run_stats *stats = options->stats;
+  if (stats)
+	stats->inputlen = inputlen;
+  enum incident_status status;
+  struct incident_program *program =
+	incident_compile(input, inputlen, &options->compile, &status);
+  if (program && options->emit) {
+	status = incident_emit_c(program, stdout);
+	incident_free(program);
+  } else if (program) {
+	struct incident_io io = {.read = read_stdin, .write = write_stdout};
+	double start = stats ? parse_clock() : 0;
+	status = incident_run(program, &io, &options->run,
+						  stats ? &stats->counts : NULL);
+	if (stats) {
+	  fflush(stdout); /* (so that the output is counted in the time) */
+	  stats->execute = parse_clock() - start;
+	}
+	incident_free(program);
+  }
+
+  switch (status) {
+  case INCIDENT_OK:
+	return 0;
+  case INCIDENT_PARSE_ERROR:
+	fprintf(stderr, "internal error: cannot parse program");
+	return 70;
+  case INCIDENT_OUTPUT_STOPPED:
+	perror("could not write output");
+	return 74;
+  default: /* (no limits are set, so memory ran out) */
+	perror("could not allocate memory");
+	return 71;
+  }
+}
+
+/* Waits until the file at path changes (in modification time, size or
+   identity) from the state stat reported in *before, or until it exists if
+   before is NULL. This polls rather than using a notification API, to work on
+   any POSIX system. */
+static void
+wait_for_change(const char *path, const struct stat *before)
+{
+  const struct timespec interval = {0, 100000000}; /* 0.1s */
+  for (;;) {
+	nanosleep(&interval, NULL);
+	struct stat now;
+	if (stat(path, &now))
+	  continue; /* probably being saved; wait for the new version */
+	if (!before || now.st_dev != before->st_dev ||
+		now.st_ino != before->st_ino || now.st_size != before->st_size ||
+		now.st_mtim.tv_sec != before->st_mtim.tv_sec ||
+		now.st_mtim.tv_nsec != before->st_mtim.tv_nsec)
+	  return;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  bool trace = false;
+  bool fragmented = false;
+  bool watch = false;
+  bool showstats = false;
+  bool emit = false;
+  int dispatch = INCIDENT_DISPATCH_NATIVE;
+  const char *cachedir = NULL;
+  struct parse_options parse_options = {0};
+  struct run_stats stats;
+
+  while (argc > 1 && *(argv[1]) == '-' && argv[1][1]) {
+	switch (argv[1][1]) {
+	case 't':
+	  trace = true;
+	  break;
+	case 'f':
+	  fragmented = true;
+	  break;
+	case 'w':
+	  watch = true;
+	  break;
+	case 'j':
+	  {
+		const char *count = argv[1][2] ? argv[1] + 2 : argc > 2 ? argv[2] : "";
+		char *end;
+		long threads = strtol(count, &end, 10);
+		if (!*count || *end || threads < 1 || threads > 4096)
+		  goto usage;
+		parse_options.threads = threads;
+		if (!argv[1][2]) {
+		  argc--;
+		  argv++;
+		}
+	  }
+	  break;
+	case '-':
+	  if (!strcmp(argv[1], "--version")) {
+		puts("incident version " INCIDENT_VERSION_STRING);
+		return 0;
+	  } else if (!strcmp(argv[1], "--")) {
+		argc--;
+		argv++;
+		goto stop_parsing_options;
+	  } else if (!strcmp(argv[1], "--engine=divsufsort")) {
+		parse_options.engine = ENGINE_DIVSUFSORT;
+		break;
+	  } else if (!strcmp(argv[1], "--engine=sais")) {
+		parse_options.engine = ENGINE_SAIS;
+		break;
+	  } else if (!strcmp(argv[1], "--engine=bwt")) {
+		parse_options.engine = ENGINE_BWT;
+		break;
+	  } else if (!strcmp(argv[1], "--lcp=phi")) {
+		parse_options.lcp = LCP_PHI;
+		break;
+	  } else if (!strcmp(argv[1], "--lcp=kasai")) {
+		parse_options.lcp = LCP_KASAI;
+		break;
+	  } else if (!strncmp(argv[1], "--cache=", 8) && argv[1][8]) {
+		cachedir = argv[1] + 8;
+		break;
+	  } else if (!strcmp(argv[1], "--stats")) {
+		showstats = true;
+		break;
+	  } else if (!strcmp(argv[1], "--emit-c")) {
+		emit = true;
+		break;
+	  } else if (!strcmp(argv[1], "--dispatch=native")) {
+		dispatch = INCIDENT_DISPATCH_NATIVE;
+		break;
+	  } else if (!strcmp(argv[1], "--dispatch=threaded")) {
+		dispatch = INCIDENT_DISPATCH_THREADED;
+		break;
+	  } else if (!strcmp(argv[1], "--dispatch=switch")) {
+		dispatch = INCIDENT_DISPATCH_SWITCH;
+		break;
+	  }
+	  /* otherwise either it's --help or it's unrecognised;
+		 fall through either way */
+	default:
+	usage:
+	  puts("Usage: incident [options] program");
+	  puts("Interprets the given Incident program (- for standard input).");
+	  puts("Available options:");
+	  puts("  -t  Display detailed trace output");
+	  puts("  -f  Debug a program fragment (start at ^, end at $)");
+	  puts("  -w  Watch the program, rerunning it (and reparsing only what "
+		   "changed) on each edit");
+	  puts("  -j N  Sort with N threads (OpenMP builds; default "
+		   "OMP_NUM_THREADS)");
+	  puts("  --engine=divsufsort|sais|bwt  Suffix sorting engine (sais also "
+		   "builds the LCP array; bwt searches a compressed index, needing "
+		   "about a third less memory but taking several times longer)");
+	  puts("  --lcp=phi|kasai  LCP construction for divsufsort (phi uses less "
+		   "memory, kasai less time; default kasai with more than one "
+		   "thread)");
+	  puts("  --cache=DIR  Keep compiled programs in DIR, to skip parsing on "
+		   "later runs");
+	  puts("  --stats  Print timings and counts for each phase of the run to "
+		   "standard error");
+	  puts("  --emit-c  Write the program out as C (a program of its own "
+		   "that runs it), rather than running it");
+	  puts("  --dispatch=native|threaded|switch  Run the program as native "
+		   "code (on x86-64), or how the interpreter goes from step to step "
+		   "(threaded is faster, where the compiler supports it)");
+	  return (argc != 2 || strcmp(argv[1], "--help")) ? 64 : 0;
+	}
+	argc--;
+	argv++;
+  }
+stop_parsing_options:
+  ;
+
+  if (argc != 2)
+	goto usage;
+  const char *filename = strcmp(argv[1], "-") ? argv[1] : NULL;
+  if (watch && !filename)
+	goto usage; /* there's nothing to watch */
+
+  if (showstats)
+	parse_options.stats = &stats.phases;
+  struct run_options options = {
+	.emit = emit,
+	.run = {
+	  .trace = trace,
+	  .dispatch = dispatch,
+	},
+	.compile = {
+	  .fragmented = fragmented,
+	  .trace = trace,
+	  .cachedir = cachedir,
+	  .parse = parse_options,
+	  .stats = showstats ? &stats.compile : NULL,
+	  .interpreted = dispatch != INCIDENT_DISPATCH_NATIVE || trace || emit,
+	},
+	.stats = showstats ? &stats : NULL,
+  };
+  if (watch &&
+	  !(options.compile.context = parse_context_new(&parse_options))) {
+	perror("could not allocate memory");
+	return 71;
+  }
+
+  /* Run the program; in watch mode, run it again whenever it changes. */
+  for (;;) {
+	struct stat before;
+	bool statted = watch && !stat(filename, &before);
+
+	/* (Watch mode copies the program, as it may change while we're
+	   parsing it. Both loaders print the error message if they fail.) */
+	saidx_t inputlen = 0;
+	bool mapped = false;
+	stats = (struct run_stats){0};
+	double start = showstats ? parse_clock() : 0;
+	const sauchar_t *input = watch ?
+	  malloc_slurp_file(filename, &inputlen) :
+	  load_file(filename, &inputlen, &mapped);
+	if (showstats)
+	  stats.load = parse_clock() - start;
+	int status = input ? run_program(input, inputlen, &options) : inputlen;
+	if (input)
+	  unload_file(input, inputlen, mapped);
+	if (showstats && !status)
+	  print_stats(&stats);
+
+	if (!watch || status == 70 || status == 71) {
+	  parse_context_free(options.compile.context);
+	  return status;
+	}
+	fflush(stdout);
+	wait_for_change(filename, statted ? &before : NULL);
+  }
+}
+
+#endif /* !BENCHMARK && !TEST */
+
+/*** End of inlined file: incident.c ***/
+
+
+/*** Start of inlined file: parse.c ***/
+//#include "incident.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+/* The general rules of parsing Incident are fairly simple: identify all
+   substrings that appear exactly three times and aren't contained in a larger
+   such substring (provisional commands) and the locations of those substrings
+   within the string (provisional incidences); then whenever two provisional
+   incidences overlap, delete both the corresponding commands from the list of
+   provisional commands to produce a final list of commands.
+
+   In order to identify substrings that have exactly three incidences, we first
+   use libdivsufsort to produce a suffix array (which has the property that if
+   you take the first n characters of each suffix in the array, you get a list
+   of n-character substrings of the input in sorted order). Then we create an
+   LCP array (which lists the number of characters that each suffix shares in
+   common with the subsequent suffix). Then we find substrings with exactly
+   three incidences via looking for sequences [a,b,c,d] in the LCP array for
+   which b and c are both larger than both a and d. */
+
+/* The time in seconds since an arbitrary point, for struct parse_stats. */
+double
+parse_clock(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Both LCP algorithms below walk the text in order, carrying a value h from
+   one suffix to the next; but h is only a lower bound on the next LCP, so the
+   walk can be cut into stretches that each start again from h = 0, at the
+   cost of rescanning one common prefix per stretch. OpenMP builds hand the
+   stretches out to threads; other builds use a single stretch. (A build can
+   set LCP_STRETCH, as make test-omp does to put many stretches in a small
+   program.)
+
+   Both walks are also bound by the latency of two random accesses per suffix
+   (to the neighbouring suffix in the suffix array, and to the text at that
+   suffix), so we prefetch those a few suffixes ahead. */
+#if defined(_OPENMP) && !defined(LCP_STRETCH)
+# define LCP_STRETCH ((saidx_t)1 << 16)
+#endif
+#define LCP_PREFETCH_DISTANCE 16
+#if defined(__GNUC__)
+# define LCP_PREFETCH(address) __builtin_prefetch(address)
+#else
+# define LCP_PREFETCH(address) ((void)0)
+#endif
+
+/* Kasai's algorithm over the text positions [from, to). */
+static void
+lcp_kasai_stretch(const sauchar_t *restrict input,
+				  const saidx_t *restrict suffixarray,
+				  saidx_t *restrict lcparray, const saidx_t *restrict rank,
+				  saidx_t inputlength, saidx_t from, saidx_t to)
+{
+  saidx_t h = 0;
+
+  for (saidx_t i = from; i < to; i++) {
+	if (i + LCP_PREFETCH_DISTANCE < to) {
+	  saidx_t ahead = rank[i + LCP_PREFETCH_DISTANCE];
+	  if (ahead > 0)
+		LCP_PREFETCH(&suffixarray[ahead - 1]);
+	  ahead = rank[i + LCP_PREFETCH_DISTANCE / 2];
+	  if (ahead > 0)
+		LCP_PREFETCH(&input[suffixarray[ahead - 1] + h]);
+	}
+
+	if (rank[i] == 0)
+	  continue;
+
+	saidx_t j = suffixarray[rank[i] - 1];
+	while (i + h < inputlength && j + h < inputlength &&
+		   input[i + h] == input[j + h])
+	  h++;
+	lcparray[rank[i] - 1] = h;
+	if (h > 0)
+	  h--;
+  }
+}
+
+/* Produce an LCP array from a suffix array, via Kasai's algorithm.
+
+   rank is scratch space of inputlength elements; its contents on return are
+   unspecified. */
+static void
+lcp_kasai(const sauchar_t *restrict input, const saidx_t *restrict suffixarray,
+		  saidx_t *restrict lcparray, saidx_t *restrict rank,
+		  saidx_t inputlength)
+{
+  /* This algorithm is taken from /Linear-Time Longest-Common-Prefix
+	 Computation in Suffix Arrays and its Implications/ (Kasai, Lee, Arimura,
+	 Arikawa, Park 2001), and was converted to C99 by Alex Smith. */
+#ifdef _OPENMP
+  saidx_t stretch = LCP_STRETCH;
+#else
+  saidx_t stretch = inputlength;
+#endif
+
+#ifdef _OPENMP
+# pragma omp parallel for schedule(static)
+#endif
+  for (saidx_t i = 0; i < inputlength; i++)
+	rank[suffixarray[i]] = i;
+
+#ifdef _OPENMP
+# pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (saidx_t from = 0; from < inputlength; from += stretch)
+	lcp_kasai_stretch(input, suffixarray, lcparray, rank, inputlength, from,
+					  inputlength - from > stretch ? from + stretch
+												   : inputlength);
+}
+
+/* The permuted LCP pass of the Phi algorithm over the text positions
+   [from, to): phi[i] holds the suffix preceding suffix i in the suffix
+   array (or a negative number for the first suffix) and is replaced by the
+   LCP of the two. */
+static void
+lcp_phi_stretch(const sauchar_t *restrict input, saidx_t *restrict phi,
+				saidx_t inputlength, saidx_t from, saidx_t to)
+{
+  saidx_t h = 0;
+
+  for (saidx_t i = from; i < to; i++) {
+	if (i + LCP_PREFETCH_DISTANCE < to &&
+		phi[i + LCP_PREFETCH_DISTANCE] >= 0)
+	  LCP_PREFETCH(&input[phi[i + LCP_PREFETCH_DISTANCE] + h]);
+
+	saidx_t j = phi[i];
+	if (j < 0) {
+	  phi[i] = h = 0; /* the lexicographically first suffix */
+	  continue;
+	}
+	while (i + h < inputlength && j + h < inputlength &&
+		   input[i + h] == input[j + h])
+	  h++;
+	phi[i] = h; /* now PLCP[i] */
+	if (h > 0)
+	  h--;
+  }
+}
+
+/* Produce an LCP array from a suffix array, using no memory beyond the LCP
+   array itself (which must have room for inputlength elements, one more than
+   the LCP array proper; the last is left unspecified).
+
+   This is the Phi algorithm from /Permuted Longest-Common-Prefix Array/
+   (Kärkkäinen, Manzini, Puglisi 2009): we first store, for each suffix in text
+   order, the suffix that precedes it in the suffix array (Phi); then replace
+   that with the LCP of the two suffixes (the permuted LCP array, which can be
+   computed in text order with the same amortization as Kasai's algorithm);
+   and finally permute it into suffix array order in place, following the
+   cycles of the permutation and using the sign bit to mark the elements that
+   have already been moved. Following the cycles is inherently serial; the
+   other passes run on several threads. */
+static void
+lcp_phi(const sauchar_t *restrict input, const saidx_t *restrict suffixarray,
+		saidx_t *restrict lcparray, saidx_t inputlength)
+{
+  saidx_t *phi = lcparray;
+#ifdef _OPENMP
+  saidx_t stretch = LCP_STRETCH;
+#else
+  saidx_t stretch = inputlength;
+#endif
+
+  phi[suffixarray[0]] = -1;
+#ifdef _OPENMP
+# pragma omp parallel for schedule(static)
+#endif
+  for (saidx_t i = 1; i < inputlength; i++)
+	phi[suffixarray[i]] = suffixarray[i - 1];
+
+#ifdef _OPENMP
+# pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (saidx_t from = 0; from < inputlength; from += stretch)
+	lcp_phi_stretch(input, phi, inputlength, from,
+					inputlength - from > stretch ? from + stretch
+												 : inputlength);
+
+  /* lcparray[r] should become PLCP[suffixarray[r + 1]]; position
+	 inputlength - 1 takes the otherwise unused PLCP[suffixarray[0]], which
+	 makes the permutation a bijection. */
+  for (saidx_t start = 0; start < inputlength; start++) {
+	if (lcparray[start] < 0)
+	  continue; /* already moved as part of an earlier cycle */
+
+	saidx_t first = lcparray[start];
+	saidx_t r = start;
+	for (;;) {
+	  saidx_t from = suffixarray[r + 1 == inputlength ? 0 : r + 1];
+	  if (from == start) {
+		lcparray[r] = ~first;
+		break;
+	  }
+	  lcparray[r] = ~lcparray[from];
+	  r = from;
+	}
+  }
+#ifdef _OPENMP
+# pragma omp parallel for schedule(static)
+#endif
+  for (saidx_t i = 0; i < inputlength; i++)
+	lcparray[i] = ~lcparray[i];
+}
+
+/* Whether the LCP array is to be built by Kasai's algorithm (and thus needs
+   a rank array). Phi's final permutation follows cycles, which is serial, so
+   Kasai's algorithm is the default whenever there are other threads. */
+static bool
+lcp_uses_kasai(const struct parse_options *options)
+{
+  if (options->engine != ENGINE_DIVSUFSORT || options->lcp == LCP_PHI)
+	return false;
+  if (options->lcp == LCP_KASAI)
+	return true;
+#ifdef _OPENMP
+  return (options->threads > 0 ? options->threads : omp_get_max_threads()) > 1;
+#else
+  return false;
+#endif
+}
+
+/* Produce an LCP array and suffix array for a given input string.
+
+   The output is written into the arrays at suffixarray and lcparray, which must
+   be pre-allocated to inputlength elements each (the last element of lcparray
+   is scratch space). rank is scratch space of inputlength elements if
+   lcp_uses_kasai, and NULL otherwise.
+
+   Returns 0 on success, negative on failure. */
+static saint_t
+suffixlcp(const sauchar_t *restrict input, saidx_t *restrict suffixarray,
+		  saidx_t *restrict lcparray, saidx_t *restrict rank,
+		  saidx_t inputlength, const struct parse_options *options)
+{
+  /* Sanity check: an LCP array requires a nonempty input string because
+	 otherwise it'd have negatively many elements */
+  if (inputlength <= 0)
+	return -3;
+
+  struct parse_stats *stats = options->stats;
+  double start = stats ? parse_clock() : 0;
+  if (options->engine == ENGINE_SAIS) {
+	saint_t rv = sais_lcp(input, suffixarray, lcparray, inputlength);
+	if (stats)
+	  stats->sort = parse_clock() - start;
+	return rv;
+  }
+
+  /* Use divsufsort to produce the suffix array. */
+#ifdef _OPENMP
+  if (options->threads > 0)
+	omp_set_num_threads(options->threads);
+#endif
+  saint_t rv = divsufsort(input, suffixarray, inputlength);
+  if (rv < 0)
+	return rv;
+  if (stats) {
+	double now = parse_clock();
+	stats->sort = now - start;
+	start = now;
+  }
+
+  if (rank)
+	lcp_kasai(input, suffixarray, lcparray, rank, inputlength);
+  else
+	lcp_phi(input, suffixarray, lcparray, inputlength);
+  if (stats)
+	stats->lcp = parse_clock() - start;
+
+  return 0;
+}
+
+/* Whether window i of the LCP array, [i-1, i, i+1, i+2], could be a
+   provisional command. */
+static inline bool
+window_is_candidate(const saidx_t *lcparray, saidx_t inputlength, saidx_t i)
+{
+  /* To have exactly 3 incidences, the LCP array needs a pattern of
+	 (i-1) short, (i) long, (i+1) long, (i+2) short. "Out of bounds" in the
+	 LCP array is effectively the same as 0, so we have inputlength - 2
+	 positions (the LCP array has inputlength - 1 positions, and we
+	 subtract 1 because i+1 has to be inbounds too). */
+  saidx_t longerboundary = (i == 0 ? 0 : lcparray[i-1]);
+  if (i < inputlength - 3 && longerboundary < lcparray[i+2])
+	longerboundary = lcparray[i+2];
+  saidx_t shorterinner = lcparray[i+1];
+  if (lcparray[i] < shorterinner)
+	shorterinner = lcparray[i];
+
+  return shorterinner > longerboundary;
+}
+
+/* Candidate finders test the 64 windows starting at lcp[0] to lcp[63] at
+   once, all of them with all four elements in bounds (they read lcp[-1] to
+   lcp[65]); bit j of the result says whether window j is a candidate. Most
+   windows aren't, so this is nearly all of the scan's work, and is
+   branch-free arithmetic on a contiguous array: there are SSE4.1 and AVX2
+   versions, chosen at runtime, for builds with 32-bit indices on x86 (with
+   64-bit indices the lanes would halve, and AVX2 has no 64-bit max or
+   min). */
+typedef uint64_t window_kernel(const saidx_t *);
+
+static uint64_t
+window_candidates_scalar(const saidx_t *lcp)
+{
+  uint64_t mask = 0;
+  for (int j = 0; j < 64; j++) {
+	saidx_t longerboundary = lcp[j-1] > lcp[j+2] ? lcp[j-1] : lcp[j+2];
+	saidx_t shorterinner = lcp[j] < lcp[j+1] ? lcp[j] : lcp[j+1];
+	mask |= (uint64_t)(shorterinner > longerboundary) << j;
+  }
+  return mask;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+  !defined(BUILD_DIVSUFSORT64)
+# define WINDOW_SIMD
+# include <immintrin.h>
+
+__attribute__((target("sse4.1"))) static uint64_t
+window_candidates_sse41(const saidx_t *lcp)
+{
+  uint64_t mask = 0;
+  for (int j = 0; j < 64; j += 4) {
+	__m128i before = _mm_loadu_si128((const __m128i *)(lcp + j - 1));
+	__m128i first = _mm_loadu_si128((const __m128i *)(lcp + j));
+	__m128i second = _mm_loadu_si128((const __m128i *)(lcp + j + 1));
+	__m128i after = _mm_loadu_si128((const __m128i *)(lcp + j + 2));
+	__m128i candidate = _mm_cmpgt_epi32(_mm_min_epi32(first, second),
+										_mm_max_epi32(before, after));
+	mask |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(candidate)) << j;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) static uint64_t
+window_candidates_avx2(const saidx_t *lcp)
+{
+  uint64_t mask = 0;
+  for (int j = 0; j < 64; j += 8) {
+	__m256i before = _mm256_loadu_si256((const __m256i *)(lcp + j - 1));
+	__m256i first = _mm256_loadu_si256((const __m256i *)(lcp + j));
+	__m256i second = _mm256_loadu_si256((const __m256i *)(lcp + j + 1));
+	__m256i after = _mm256_loadu_si256((const __m256i *)(lcp + j + 2));
+	__m256i candidate =
+	  _mm256_cmpgt_epi32(_mm256_min_epi32(first, second),
+						 _mm256_max_epi32(before, after));
+	mask |= (uint64_t)(uint32_t)
+	  _mm256_movemask_ps(_mm256_castsi256_ps(candidate)) << j;
+  }
+  return mask;
+}
+#endif
+
+static inline int
+lowest_set_bit(uint64_t mask)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(mask);
+#else
+  int bit = 0;
+  while (!(mask & 1)) {
+	mask >>= 1;
+	bit++;
+  }
+  return bit;
+#endif
+}
+
+static window_kernel *
+select_window_kernel(void)
+{
+#ifdef WINDOW_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+	return window_candidates_avx2;
+  if (__builtin_cpu_supports("sse4.1"))
+	return window_candidates_sse41;
+#endif
+  return window_candidates_scalar;
+}
+
+/* Scans the LCP windows [i-1, i, i+1, i+2] for i in [from, to) for
+   provisional commands, writing their incidences to incidences (if it isn't
+   NULL). Returns the number of provisional commands found. */
+static saidx_t
+scan_incidence_windows(
+  const sauchar_t *restrict input, const saidx_t *restrict suffixarray,
+  const saidx_t *restrict lcparray, struct incidence *restrict incidences,
+  saidx_t inputlength, saidx_t from, saidx_t to, window_kernel *kernel)
+{
+  /* The first window and the last three have out-of-bounds elements, so
+	 they (and any windows left over at the end) are tested one at a time;
+	 the rest go to the kernel 64 at a time. */
+  saidx_t kernelend = to < inputlength - 3 ? to : inputlength - 3;
+  saidx_t incidencecount = 0;
+  for (saidx_t block = from; block < to; ) {
+	uint64_t candidates;
+	saidx_t width;
+	if (block > 0 && kernelend - block >= 64) {
+	  candidates = kernel(lcparray + block);
+	  width = 64;
+	} else {
+	  candidates = window_is_candidate(lcparray, inputlength, block);
+	  width = 1;
+	}
+
+	for (; candidates; candidates &= candidates - 1) {
+	  saidx_t i = block + lowest_set_bit(candidates);
+	  saidx_t shorterinner = lcparray[i+1];
+	  if (lcparray[i] < shorterinner)
+		shorterinner = lcparray[i];
+
+	  /* The substrings starting at suffixarray[i, i+1, i+2] with length
+		 shorterinner will all be identical (because their first shorterinner
+		 characters are identical via the definition of the LCP array), and
+		 there will be no other incidences of them (because such an incidence
+		 would have to appear next to the others in the suffix array, but the
+		 LCP array says that no more than longerboundary characters match at
+		 the start). We also know that the substring is not a prefix of a
+		 longer provisional command (because otherwise longerboundary would be
+		 higher). It might be a suffix of a longer provisional command,
+		 though; to discount this we need to look at the preceding characters
+		 in the input and make sure they aren't all the same. */
+	  if (suffixarray[i] > 0 && suffixarray[i+1] > 0 &&
+		  suffixarray[i+2] > 0 &&
+		  input[suffixarray[i] - 1] == input[suffixarray[i+1] - 1] &&
+		  input[suffixarray[i] - 1] == input[suffixarray[i+2] - 1])
+		continue;
+
+	  /* OK, it's definitely a provisional command. Record it. */
+	  if (incidences) {
+		incidences[incidencecount++] = (struct incidence){
+		  .start = suffixarray[i],   .length = shorterinner};
+		incidences[incidencecount++] = (struct incidence){
+		  .start = suffixarray[i+1], .length = shorterinner};
+		incidences[incidencecount++] = (struct incidence){
+		  .start = suffixarray[i+2], .length = shorterinner};
+	  } else
+		incidencecount += 3;
+	}
+	block += width;
+  }
+
+  return incidencecount / 3;
+}
+
+/* How many windows find_commands_and_incidences scans in each chunk (which a
+   build can set, as make test-omp does). */
+#if defined(_OPENMP) && !defined(WINDOW_CHUNK)
+# define WINDOW_CHUNK ((saidx_t)1 << 16)
+#endif
+
 /* Given an LCP array and suffix array, identify all provisional commands within
    it and all incidences of those provisional commands. (A provisional command
    is a string that has exactly three incidences.) Provisional commands won't be
    returned if they're substrings of a longer command.
 
-   Returns the number of provisional commands. (There is no failure state; the
-   caller has to verify that the input is long enough to have a meaningful LCP
-   array.) The output is written into the given output array, which must be long
-   enough to hold all the incidences (recommended length: equal to that of the
-   input array); to get a list of provisional commands, take every third
-   incidence. */
+   Returns the number of provisional commands. (There is no failure state; the
+   caller has to verify that the input is long enough to have a meaningful LCP
+   array.) The output is written into the given output array, which must be long
+   enough to hold all the incidences (three per provisional command, so a call
+   with a NULL output array, which just counts them, tells you how much room
+   is needed); to get a list of provisional commands, take every third
+   incidence.
+
+   Every window is independent of the others, so OpenMP builds scan chunks of
+   windows on several threads: first counting the commands in each chunk, then
+   (after a prefix sum over the counts) writing each chunk's incidences into
+   its own part of the output. The output is identical to a serial scan. */
+static saidx_t
+find_commands_and_incidences(
+  const sauchar_t *restrict input, const saidx_t *restrict suffixarray,
+  const saidx_t *restrict lcparray,
+  struct incidence *restrict incidences, saidx_t inputlength)
+{
+  saidx_t windows = inputlength - 2;
+  if (windows <= 0)
+	return 0;
+  window_kernel *kernel = select_window_kernel();
+
+#ifdef _OPENMP
+  saidx_t chunks = (windows - 1) / WINDOW_CHUNK + 1;
+  saidx_t *chunkstart;
+  /* If there is only one chunk, or no room for the counts, scan serially. */
+  if (chunks > 1 &&
+	  (chunkstart = malloc((chunks + 1) * sizeof *chunkstart)) != NULL) {
+# pragma omp parallel for schedule(dynamic, 1)
+	for (saidx_t c = 0; c < chunks; c++) {
+	  saidx_t from = c * WINDOW_CHUNK;
+	  saidx_t to =
+		windows - from > WINDOW_CHUNK ? from + WINDOW_CHUNK : windows;
+	  chunkstart[c + 1] = scan_incidence_windows(
+		input, suffixarray, lcparray, NULL, inputlength, from, to, kernel);
+	}
+
+	chunkstart[0] = 0;
+	for (saidx_t c = 0; c < chunks; c++)
+	  chunkstart[c + 1] += chunkstart[c];
+
+	if (incidences) {
+#  pragma omp parallel for schedule(dynamic, 1)
+	  for (saidx_t c = 0; c < chunks; c++) {
+		saidx_t from = c * WINDOW_CHUNK;
+		saidx_t to =
+		  windows - from > WINDOW_CHUNK ? from + WINDOW_CHUNK : windows;
+		scan_incidence_windows(input, suffixarray, lcparray,
+							   incidences + 3 * chunkstart[c], inputlength,
+							   from, to, kernel);
+	  }
+	}
+
+	saidx_t commandcount = chunkstart[chunks];
+	free(chunkstart);
+	return commandcount;
+  }
+#endif
+
+  return scan_incidence_windows(input, suffixarray, lcparray, incidences,
+								inputlength, 0, windows, kernel);
+}
+
+/* Given the incidences of the provisional commands found by
+   find_commands_and_incidences, deletes those that overlap and numbers the
+   rest, writing the result to parsed (which must be all zeroes) as described
+   for lexical_parse. newnumbers (commands elements) and order (commands * 3
+   elements) are scratch space. If stats isn't NULL, the time taken goes in
+   its resolve and relabel fields.
+
+   Returns the number of non-provisional commands. */
+static saidx_t
+resolve_overlaps(saidx_t *restrict parsed, saidx_t inputlength,
+				 const struct incidence *restrict incidences, saidx_t commands,
+				 saidx_t *restrict newnumbers, saidx_t *restrict order,
+				 struct parse_stats *stats)
+{
+  double start = stats ? parse_clock() : 0;
+
+  /* Sort the incidences by start position. This is a counting sort, using
+	 parsed (which is zeroed again afterwards) for the counts; the sorted list
+	 of incidence numbers goes in order. */
+  saidx_t incidencecount = commands * 3;
+  for (saidx_t i = 0; i < incidencecount; i++)
+	parsed[incidences[i].start]++;
+  for (saidx_t i = 0, total = 0; i < inputlength; i++) {
+	saidx_t count = parsed[i];
+	parsed[i] = total;
+	total += count;
+  }
+  for (saidx_t i = 0; i < incidencecount; i++)
+	order[parsed[incidences[i].start]++] = i;
+  for (saidx_t i = 0; i < inputlength; i++)
+	parsed[i] = 0;
+
+  /* Record a mapping between "old" and "new" command numbers. "old" number =
+	 key = location in the incidences array divided by 3. "new" number = value =
+	 0 for deleted, 1 for "value hasn't been determined yet", otherwise a
+	 number that's 2 mod 3 (one less than the first incidence's number).
+
+	 Any overlap between two incidences deletes both their commands. In start
+	 order, an incidence overlaps another if and only if an earlier incidence
+	 ends after it starts, or the next incidence starts before it ends. */
+  for (saidx_t i = 0; i < commands; i++)
+	newnumbers[i] = 1;
+
+  saidx_t maxend = 0;
+  for (saidx_t i = 0; i < incidencecount; i++) {
+	const struct incidence *this = &incidences[order[i]];
+	saidx_t end = this->start + this->length;
+	if (maxend > this->start ||
+		(i + 1 < incidencecount && incidences[order[i + 1]].start < end))
+	  newnumbers[order[i] / 3] = 0;
+	if (end > maxend)
+	  maxend = end;
+  }
+
+  if (stats) {
+	double now = parse_clock();
+	stats->resolve = now - start;
+	start = now;
+  }
+
+  /* Assign arbitrary command numbers, keeping the numbers as low as
+	 possible. */
+  saidx_t newnumber = 2;
+  for (saidx_t i = 0; i < commands; i++) {
+	if (!newnumbers[i])
+	  continue;
+	newnumbers[i] = newnumber;
+	newnumber += 3;
+  }
+
+  /* Sweep the incidences in start order again, writing the octets of each
+	 that no earlier incidence covers (with 1 if its command was deleted, or
+	 the number of its incidence otherwise), and marking the octets that an
+	 earlier incidence does cover with 2. Each octet is written at most twice,
+	 because the covered parts are written as a running union (everything
+	 before marked has been marked already). */
+  maxend = 0;
+  saidx_t marked = 0;
+  for (saidx_t i = 0; i < incidencecount; i++) {
+	saidx_t old_command_number = order[i] / 3;
+	const struct incidence *this = &incidences[order[i]];
+	saidx_t end = this->start + this->length;
+
+	saidx_t from = this->start > marked ? this->start : marked;
+	saidx_t to = end < maxend ? end : maxend;
+	for (saidx_t j = from; j < to; j++)
+	  parsed[j] = 2;
+	if (to > marked)
+	  marked = to;
+
+	if (end <= maxend)
+	  continue;
+
+	saidx_t value = 1; /* the command was deleted due to overlap */
+	if (newnumbers[old_command_number]) {
+	  /* Differentiate the three incidences by their order in the program. */
+	  const struct incidence *first = &incidences[old_command_number * 3];
+	  value = newnumbers[old_command_number] + 1 +
+		(this->start > first[0].start) + (this->start > first[1].start) +
+		(this->start > first[2].start);
+	}
+	for (saidx_t j = this->start > maxend ? this->start : maxend; j < end; j++)
+	  parsed[j] = value;
+	maxend = end;
+  }
+  if (stats)
+	stats->relabel = parse_clock() - start;
+
+  return newnumber / 3; /* remainder is necessarily 2 */
+}
+
+/* Parses the input as an Incident program. The input is a sequence of
+   octets in (input, inputlength). The output lists a lexical category
+   for each octet of the input:
+
+   0 - not part of an incidence of a command or provisional command
+   1 - part of an incidence of one non-command provisional command
+   2 - part of an incidence of multiple provisional commands
+
+   Higher numbers represent incidences of (non-provisional) commands.
+   These use arbitrary numbers >= 2, but incidences of the same command
+   will have the same value / 3, and the value % 3 gives the position:
+
+   0 - first incidence;
+   1 - middle incidence;
+   2 - last incidence.
+
+   All scratch space is taken from the heap, so the size of the program is
+   limited by available memory rather than by the stack; parsed (which must
+   have room for inputlength elements) doubles as scratch space. options may
+   be NULL to use the defaults.
+
+   Returns the number of non-provisional commands seen on success, negative on
+   failure (-2 if memory could not be allocated). */
+saidx_t
+lexical_parse(const sauchar_t *restrict input, saidx_t *restrict parsed,
+			  saidx_t inputlength, const struct parse_options *options)
+{
+  static const struct parse_options default_options = {0};
+  if (!options)
+	options = &default_options;
+  struct parse_stats *stats = options->stats;
+  if (stats)
+	*stats = (struct parse_stats){0};
+
+  /* Special case: very short inputs can't go through the normal codepaths
+	 because the arrays would be too small, but they also can't contain any
+	 even provisional commands and thus are trivial to parse. */
+  if (inputlength < 3) {
+	for (saidx_t i = 0; i < inputlength; i++)
+	  parsed[i] = 0;
+	return 0;
+  }
+
+  /* The phases of the parse need different buffers, whose lifetimes we
+	 overlay to keep the peak memory use down. With n octets of input and c
+	 provisional commands:
+
+	 - building the suffix and LCP arrays needs the suffix array and the LCP
+	   array, which lives in parsed (it isn't needed until later); Kasai's
+	   LCP algorithm also needs a rank array;
+	 - the window scan needs those two arrays and the incidences, which a
+	   counting pass of the scan sizes exactly;
+	 - overlap resolution needs the incidences, parsed, and four elements per
+	   command of scratch space, which reuse the suffix array if that's large
+	   enough (c <= n/4, as it is for nearly every program).
+
+	 Counting parsed, the peak is thus 2n indices (3n with Kasai's LCP
+	 algorithm) plus 3c incidences, or max(8n + 24c, 12n) bytes with 32-bit
+	 indices; if c > n/4, resolving overlaps needs 4n + 40c bytes instead.
+	 ENGINE_BWT replaces the first two phases with a search of a compressed
+	 index, which peaks at about 5.5n + 24c bytes with 32-bit indices (see
+	 fmindex.c), and always takes the overlap scratch space from the heap.
+	 The input itself is the caller's. */
+  struct incidence *incidences;
+  saidx_t commands;
+  saidx_t *suffixarray = NULL;
+  if (options->engine == ENGINE_BWT) {
+#ifdef _OPENMP
+	if (options->threads > 0)
+	  omp_set_num_threads(options->threads);
+#endif
+	commands = fmindex_commands(input, parsed, inputlength, &incidences,
+								stats);
+	if (commands < 0)
+	  return commands;
+	goto resolve;
+  }
+
+  bool kasai = lcp_uses_kasai(options);
+  suffixarray = malloc(inputlength * sizeof *suffixarray);
+  saidx_t *rank = kasai ? malloc(inputlength * sizeof *rank) : NULL;
+  if (!suffixarray || (kasai && !rank)) {
+	free(rank);
+	free(suffixarray);
+	return -2;
+  }
+  saidx_t *lcparray = parsed;
+
+  saint_t rv = suffixlcp(input, suffixarray, lcparray, rank, inputlength,
+						 options);
+  free(rank);
+  if (rv < 0) {
+	free(suffixarray);
+	return rv;
+  }
+
+  /* Find the commands and their incidences. */
+  double start = stats ? parse_clock() : 0;
+  commands = find_commands_and_incidences(
+	input, suffixarray, lcparray, NULL, inputlength);
+  incidences = malloc(((size_t)commands * 3 + 1) * sizeof *incidences);
+  if (!incidences) {
+	free(suffixarray);
+	return -2;
+  }
+  find_commands_and_incidences(input, suffixarray, lcparray, incidences,
+							   inputlength);
+  if (stats)
+	stats->scan = parse_clock() - start;
+
+  /* The suffix and LCP arrays are dead now. */
+  for (saidx_t i = 0; i < inputlength; i++)
+	parsed[i] = 0;
+resolve:
+  if (stats)
+	stats->provisional = commands;
+  saidx_t *scratch = suffixarray;
+  if (!scratch || (size_t)commands * 4 > (size_t)inputlength) {
+	free(suffixarray);
+	scratch = malloc(((size_t)commands * 4 + 1) * sizeof *scratch);
+	if (!scratch) {
+	  free(incidences);
+	  return -2;
+	}
+  }
+
+  saidx_t commandcount = resolve_overlaps(parsed, inputlength, incidences,
+										  commands, scratch,
+										  scratch + commands, stats);
+
+  free(scratch);
+  free(incidences);
+  return commandcount;
+}
+
+/* Incremental parsing. A parse context remembers the last program it parsed,
+   along with that program's suffix and LCP arrays. Given a new version of the
+   program, it finds the region that changed (everything between the longest
+   common prefix and the longest common suffix of the two versions) and
+   updates the arrays rather than building them again.
+
+   This works because the order of two suffixes, and the LCP between them,
+   depend only on the octets up to their first mismatch. A suffix that starts
+   before the changed region, and shares fewer octets than its distance to the
+   region with both of its neighbours in the suffix array, thus keeps its
+   place relative to all other such suffixes and to all suffixes that start
+   after the region. Every other suffix is removed, then reinserted (along with
+   the suffixes that start inside the region) by binary search. That is a few
+   linear passes over the arrays, rather than a sort; but if there are many
+   suffixes to reinsert (as there are near long repeats), or comparing them
+   gets expensive, we build the arrays from scratch instead.
+
+   The window scan and overlap resolution are linear, so they just run
+   again. */
+struct parse_context {
+  struct parse_options options;
+  sauchar_t *input;      /* the last program parsed */
+  saidx_t inputlength;
+  saidx_t *suffixarray;  /* and its suffix and LCP arrays */
+  saidx_t *lcparray;
+  bool indexed;          /* whether those arrays are valid */
+  saidx_t capacity;      /* allocated elements of each of the above */
+};
+
+/* Returns a new parse context, or NULL if memory could not be allocated.
+   options may be NULL to use the defaults. */
+struct parse_context *
+parse_context_new(const struct parse_options *options)
+{
+  struct parse_context *context = calloc(1, sizeof *context);
+  if (context && options)
+	context->options = *options;
+  return context;
+}
+
+void
+parse_context_free(struct parse_context *context)
+{
+  if (!context)
+	return;
+  free(context->input);
+  free(context->suffixarray);
+  free(context->lcparray);
+  free(context);
+}
+
+/* Compares suffixes x and y of the input, returning a negative number if x
+   sorts first and a positive number if y does, and storing their LCP in *lcp.
+   Each octet compared is deducted from *budget. */
+static int
+compare_suffixes(const sauchar_t *input, saidx_t inputlength, saidx_t x,
+				 saidx_t y, saidx_t *lcp, int64_t *budget)
+{
+  saidx_t h = 0;
+  while (x + h < inputlength && y + h < inputlength &&
+		 input[x + h] == input[y + h])
+	h++;
+  *lcp = h;
+  *budget -= h + 1;
+  if (x + h == inputlength)
+	return -1; /* a suffix sorts before the suffixes it's a prefix of */
+  if (y + h == inputlength)
+	return 1;
+  return input[x + h] < input[y + h] ? -1 : 1;
+}
+
+/* Sorts count suffixes of the input, using scratch (count elements) as
+   scratch space. Stops early (leaving suffixes in an unspecified order) if
+   *budget runs out. */
+static void
+sort_suffixes(const sauchar_t *input, saidx_t inputlength, saidx_t *suffixes,
+			  saidx_t *scratch, saidx_t count, int64_t *budget)
+{
+  /* A bottom-up merge sort, alternating between the two arrays. */
+  saidx_t *from = suffixes, *to = scratch;
+  for (saidx_t width = 1; width < count; width *= 2) {
+	for (saidx_t left = 0; left < count; left += 2 * width) {
+	  saidx_t middle = count - left > width ? left + width : count;
+	  saidx_t right = count - middle > width ? middle + width : count;
+	  saidx_t i = left, j = middle, k = left, lcp;
+	  while (i < middle && j < right) {
+		if (compare_suffixes(input, inputlength, from[i], from[j], &lcp,
+							 budget) < 0)
+		  to[k++] = from[i++];
+		else
+		  to[k++] = from[j++];
+	  }
+	  while (i < middle)
+		to[k++] = from[i++];
+	  while (j < right)
+		to[k++] = from[j++];
+	}
+	if (*budget < 0)
+	  return;
+	saidx_t *swap = from;
+	from = to;
+	to = swap;
+  }
+  if (from != suffixes)
+	memcpy(suffixes, from, count * sizeof *suffixes);
+}
+
+/* Updates the context's suffix and LCP arrays for the new version input of
+   its program, in which the octets [prefix, inputlength - suffix) replace the
+   octets [prefix, context->inputlength - suffix) of the old version. The
+   arrays must have room for inputlength elements.
+
+   Returns 0 on success, 1 if it would be cheaper to build the arrays from
+   scratch, or -2 if memory could not be allocated; in either of the latter
+   cases the arrays are left in an unspecified state. */
+static saint_t
+update_suffixlcp(struct parse_context *context, const sauchar_t *input,
+				 saidx_t inputlength, saidx_t prefix, saidx_t suffix)
+{
+  saidx_t *suffixarray = context->suffixarray;
+  saidx_t *lcparray = context->lcparray;
+  saidx_t oldlength = context->inputlength;
+  saidx_t oldend = oldlength - suffix, newend = inputlength - suffix;
+  int64_t budget = inputlength / 2 + 4096;
+
+#define NEIGHBOUR_LCP(i) \
+  ((i) == 0 ? lcparray[0] : (i) == oldlength - 1 ? lcparray[(i) - 1] : \
+   lcparray[(i) - 1] > lcparray[i] ? lcparray[(i) - 1] : lcparray[i])
+
+  /* Count the suffixes to reinsert, to see if it's worth it. */
+  saidx_t freshcount = newend - prefix;
+  for (saidx_t i = 0; i < oldlength; i++)
+	if (suffixarray[i] < prefix && suffixarray[i] + NEIGHBOUR_LCP(i) >= prefix)
+	  freshcount++;
+  if (freshcount > inputlength / 8)
+	return 1;
+
+  saidx_t *fresh = malloc(((size_t)freshcount * 3 + 1) * sizeof *fresh);
+  if (!fresh)
+	return -2;
+  saidx_t *scratch = fresh + freshcount, *insertion = scratch + freshcount;
+
+  /* Remove the suffixes to reinsert, renumbering the suffixes after the
+	 changed region as we go. The LCP between two suffixes that become
+	 neighbours is the least LCP between the suffixes that were between
+	 them. */
+  saidx_t kept = 0, freshfound = 0, runmin = 0;
+  for (saidx_t i = 0; i < oldlength; i++) {
+	saidx_t p = suffixarray[i];
+	saidx_t right = i < oldlength - 1 ? lcparray[i] : 0;
+	bool keep;
+	if (p >= oldend) {
+	  p += inputlength - oldlength;
+	  keep = true;
+	} else if (p >= prefix)
+	  keep = false; /* starts in the old version of the region */
+	else if (p + NEIGHBOUR_LCP(i) >= prefix) {
+	  fresh[freshfound++] = p;
+	  keep = false;
+	} else
+	  keep = true;
+
+	if (keep) {
+	  if (kept > 0)
+		lcparray[kept - 1] = runmin;
+	  suffixarray[kept++] = p;
+	  runmin = right;
+	} else if (right < runmin)
+	  runmin = right;
+  }
+#undef NEIGHBOUR_LCP
+  for (saidx_t p = prefix; p < newend; p++)
+	fresh[freshfound++] = p;
+
+  /* Sort the suffixes to reinsert, and find where each goes among those that
+	 were kept (as the number of kept suffixes that sort before it). */
+  sort_suffixes(input, inputlength, fresh, scratch, freshcount, &budget);
+  saidx_t low = 0, lcp;
+  for (saidx_t j = 0; j < freshcount && budget >= 0; j++) {
+	saidx_t high = kept;
+	while (low < high) {
+	  saidx_t middle = low + (high - low) / 2;
+	  if (compare_suffixes(input, inputlength, fresh[j], suffixarray[middle],
+						   &lcp, &budget) < 0)
+		high = middle;
+	  else
+		low = middle + 1;
+	}
+	insertion[j] = low;
+  }
+
+  /* Merge them in from the end backwards, so that nothing is overwritten
+	 before it's read. Two kept suffixes that end up next to each other were
+	 next to each other after the removal, so their LCP is known; any other
+	 LCP has to be found by comparison. Once everything has been reinserted,
+	 the rest of the arrays is already in place. */
+  saidx_t i = kept - 1, j = freshcount - 1, next = 0;
+  bool nextkept = false;
+  for (saidx_t w = inputlength - 1; w >= 0 && budget >= 0; w--) {
+	if (j < 0 && nextkept)
+	  break;
+
+	saidx_t p;
+	bool iskept = !(j >= 0 && insertion[j] > i);
+	if (iskept)
+	  p = suffixarray[i--];
+	else
+	  p = fresh[j--];
+
+	if (w < inputlength - 1) {
+	  if (iskept && nextkept)
+		lcparray[w] = lcparray[i + 1];
+	  else {
+		compare_suffixes(input, inputlength, p, next, &lcp, &budget);
+		lcparray[w] = lcp;
+	  }
+	}
+	suffixarray[w] = p;
+	next = p;
+	nextkept = iskept;
+  }
+
+  free(fresh);
+  return budget < 0;
+}
+
+/* Like lexical_parse, but parses the input incrementally relative to the
+   last program parsed with the given context (or from scratch, if there is
+   none or the programs are too different), and remembers it for next time. */
+saidx_t
+lexical_reparse(struct parse_context *context,
+				const sauchar_t *restrict input, saidx_t *restrict parsed,
+				saidx_t inputlength)
+{
+  /* ENGINE_BWT exists to avoid holding the arrays that updating needs, so
+	 it always parses from scratch. */
+  if (context->options.engine == ENGINE_BWT)
+	return lexical_parse(input, parsed, inputlength, &context->options);
+
+  struct parse_stats *stats = context->options.stats;
+  if (stats)
+	*stats = (struct parse_stats){0};
+  double start = stats ? parse_clock() : 0;
+
+  for (saidx_t i = 0; i < inputlength; i++)
+	parsed[i] = 0;
+
+  /* Make room for the new version, with some slack for further edits. */
+  if (inputlength > context->capacity) {
+	saidx_t capacity = inputlength > SAIDX_MAX - inputlength / 8 ?
+	  SAIDX_MAX : inputlength + inputlength / 8;
+	sauchar_t *newinput = realloc(context->input, capacity);
+	if (newinput)
+	  context->input = newinput;
+	saidx_t *newsuffixarray =
+	  realloc(context->suffixarray, capacity * sizeof *newsuffixarray);
+	if (newsuffixarray)
+	  context->suffixarray = newsuffixarray;
+	saidx_t *newlcparray =
+	  realloc(context->lcparray, capacity * sizeof *newlcparray);
+	if (newlcparray)
+	  context->lcparray = newlcparray;
+	if (!newinput || !newsuffixarray || !newlcparray)
+	  return -2;
+	context->capacity = capacity;
+  }
+
+  /* Find the changed region, and update the arrays for it if we can. */
+  saint_t rv = 1;
+  if (context->indexed && inputlength >= 3) {
+	saidx_t shorter = inputlength < context->inputlength ?
+	  inputlength : context->inputlength;
+	saidx_t prefix = 0, suffix = 0;
+	while (prefix < shorter && input[prefix] == context->input[prefix])
+	  prefix++;
+	while (suffix < shorter - prefix &&
+		   input[inputlength - 1 - suffix] ==
+		   context->input[context->inputlength - 1 - suffix])
+	  suffix++;
+
+	if (prefix == inputlength && inputlength == context->inputlength)
+	  rv = 0; /* nothing changed */
+	else
+	  rv = update_suffixlcp(context, input, inputlength, prefix, suffix);
+  }
+
+  memcpy(context->input, input, inputlength);
+  context->inputlength = inputlength;
+  context->indexed = false;
+  if (rv < 0)
+	return rv;
+
+  /* Special case: very short inputs have no LCP array (see lexical_parse). */
+  if (inputlength < 3)
+	return 0;
+
+  if (rv > 0) {
+	/* (The time spent trying to update counts towards the sort.) */
+	double attempt = stats ? parse_clock() - start : 0;
+	saidx_t *rank = NULL;
+	if (lcp_uses_kasai(&context->options) &&
+		!(rank = malloc(inputlength * sizeof *rank)))
+	  return -2;
+	rv = suffixlcp(input, context->suffixarray, context->lcparray, rank,
+				   inputlength, &context->options);
+	free(rank);
+	if (rv < 0)
+	  return rv;
+	if (stats)
+	  stats->sort += attempt;
+  } else if (stats)
+	stats->sort = parse_clock() - start;
+  context->indexed = true;
+
+  /* The arrays belong to the context, so the rest of the parse needs scratch
+	 space of its own, sized as in lexical_parse. */
+  start = stats ? parse_clock() : 0;
+  saidx_t commands = find_commands_and_incidences(
+	input, context->suffixarray, context->lcparray, NULL, inputlength);
+  struct incidence *incidences =
+	malloc(((size_t)commands * 3 + 1) * sizeof *incidences);
+  saidx_t *scratch = malloc(((size_t)commands * 4 + 1) * sizeof *scratch);
+  if (!incidences || !scratch) {
+	free(scratch);
+	free(incidences);
+	return -2;
+  }
+
+  find_commands_and_incidences(input, context->suffixarray,
+							   context->lcparray, incidences, inputlength);
+  if (stats) {
+	stats->scan = parse_clock() - start;
+	stats->provisional = commands;
+  }
+  saidx_t commandcount = resolve_overlaps(parsed, inputlength, incidences,
+										  commands, scratch,
+										  scratch + commands,
+										  context->options.stats);
+
+  free(scratch);
+  free(incidences);
+  return commandcount;
+}
+
+#if defined(TEST) && TEST == 1
+int
+main(void)
+{
+  const sauchar_t testinput[] =
+	"aaabcbcbcdefdfefedghijghighjkllkklmmmmonono-nonppqpq-pqprsrsrstststuvuvu";
+#define TESTLENGTH (sizeof testinput - 1) /* remove the NUL */
+  saidx_t suffixarray[TESTLENGTH];
+  saidx_t lcparray[TESTLENGTH];
+  struct parse_options options = {0};
+
+  saint_t rv = suffixlcp(testinput, suffixarray, lcparray, NULL, TESTLENGTH,
+						 &options);
+  if (rv < 0) {
+	fprintf(stderr, "suffixlcp failed: error code %d\n", rv);
+	return 70;
+  }
+
+  for (saidx_t i = 0; i < TESTLENGTH; i++) {
+	printf("%4u%4u%4u %.4s\n", (unsigned)i, (unsigned)suffixarray[i],
+		   i == TESTLENGTH - 1 ? 0 : (unsigned)lcparray[i],
+		   testinput + suffixarray[i]);
+  }
+
+  printf("\n");
+
+  struct incidence incidences[TESTLENGTH];
+  saidx_t commands = find_commands_and_incidences(
+	testinput, suffixarray, lcparray, incidences, TESTLENGTH);
+
+  for (saidx_t i = 0; i < commands * 3; i++) {
+	printf("%4d%4u%4u %.*s\n", (int)(i/3), (unsigned)incidences[i].start,
+		   (unsigned)incidences[i].length, (int)incidences[i].length,
+		   testinput + incidences[i].start);
+  }
+
+  printf("\n");
+
+  saidx_t parsed[TESTLENGTH];
+  rv = lexical_parse(testinput, parsed, TESTLENGTH, &options);
+  if (rv < 0) {
+	fprintf(stderr, "lexical_parse failed: error code %d\n", rv);
+	return 70;
+  }
+
+  for (unsigned i = 0; i < TESTLENGTH; i++) {
+	printf("%4u %c%4u\n", i, testinput[i], (unsigned)parsed[i]);
+  }
+
+  printf("\n");
+
+  return 0;
+}
+#endif
+
+#if defined(TEST) && TEST == 2
+/* A deliberately simple parser, as an oracle for the fast ones: it follows
+   the rules at the top of this file directly, with no suffix array, in
+   quadratic time or worse. For each position, it follows the occurrences of
+   the substrings starting there as they get longer, and takes those with
+   exactly three occurrences (overlapping ones included) that are maximal
+   both ways; then it deletes every command that has an incidence sharing an
+   octet with any other incidence.
+
+   lexical_parse numbers the commands in the suffix array order of their
+   strings (no command can be a prefix of another, as the shorter would not
+   be maximal), so this does too, to give the same parsed octet for octet. */
+
+struct reference_command {
+  saidx_t starts[3];
+  saidx_t length;
+  bool deleted;
+};
+
+/* Whether command a's string sorts after command b's. */
+static bool
+reference_after(const sauchar_t *input, const struct reference_command *a,
+				const struct reference_command *b)
+{
+  saidx_t length = a->length < b->length ? a->length : b->length;
+  int order = memcmp(input + a->starts[0], input + b->starts[0], length);
+  return order ? order > 0 : a->length > b->length;
+}
+
+/* Parses like lexical_parse. Returns the number of commands, or -2 if memory
+   could not be allocated. */
+static saidx_t
+reference_parse(const sauchar_t *input, saidx_t *parsed, saidx_t inputlength)
+{
+  saidx_t *occurrences = malloc((inputlength + 1) * sizeof *occurrences);
+  saidx_t *cover = calloc(inputlength + 1, sizeof *cover);
+  saidx_t commandcount = 0, commandalloc = 16;
+  struct reference_command *commands =
+	malloc(commandalloc * sizeof *commands);
+  if (!occurrences || !cover || !commands)
+	goto oom;
+
+  for (saidx_t i = 0; i < inputlength; i++) {
+	saidx_t count = 0;
+	for (saidx_t j = 0; j < inputlength; j++)
+	  if (input[j] == input[i])
+		occurrences[count++] = j;
+
+	/* occurrences holds those of input[i, i + length), in order. */
+	for (saidx_t length = 1; count >= 3; length++) {
+	  /* Count each substring only at its first occurrence. */
+	  if (count == 3 && occurrences[0] == i) {
+		const saidx_t *o = occurrences;
+		bool rightmaximal = o[2] + length == inputlength ||
+		  input[o[0] + length] != input[o[1] + length] ||
+		  input[o[0] + length] != input[o[2] + length];
+		bool leftmaximal = o[0] == 0 ||
+		  input[o[0] - 1] != input[o[1] - 1] ||
+		  input[o[0] - 1] != input[o[2] - 1];
+		if (rightmaximal && leftmaximal) {
+		  if (commandcount == commandalloc) {
+			struct reference_command *more = realloc(
+			  commands, commandalloc * 2 * sizeof *commands);
+			if (!more)
+			  goto oom;
+			commands = more;
+			commandalloc *= 2;
+		  }
+		  commands[commandcount++] = (struct reference_command){
+			{o[0], o[1], o[2]}, length, false};
+		}
+	  }
+
+	  if (i + length == inputlength)
+		break;
+	  saidx_t kept = 0;
+	  for (saidx_t k = 0; k < count; k++)
+		if (occurrences[k] + length < inputlength &&
+			input[occurrences[k] + length] == input[i + length])
+		  occurrences[kept++] = occurrences[k];
+	  count = kept;
+	}
+  }
+
+  /* Sort the commands by their strings (an insertion sort, for simplicity). */
+  for (saidx_t i = 1; i < commandcount; i++) {
+	struct reference_command command = commands[i];
+	saidx_t j = i;
+	for (; j > 0 && reference_after(input, &commands[j - 1], &command); j--)
+	  commands[j] = commands[j - 1];
+	commands[j] = command;
+  }
+
+  /* Count how many incidences cover each octet; two incidences overlap
+	 if they both cover an octet, which deletes both their commands. */
+  for (saidx_t c = 0; c < commandcount; c++)
+	for (int k = 0; k < 3; k++)
+	  for (saidx_t j = commands[c].starts[k];
+		   j < commands[c].starts[k] + commands[c].length; j++)
+		cover[j]++;
+  for (saidx_t c = 0; c < commandcount; c++)
+	for (int k = 0; k < 3; k++)
+	  for (saidx_t j = commands[c].starts[k];
+		   j < commands[c].starts[k] + commands[c].length; j++)
+		if (cover[j] > 1)
+		  commands[c].deleted = true;
+
+  for (saidx_t j = 0; j < inputlength; j++)
+	parsed[j] = cover[j] > 1 ? 2 : 0;
+  saidx_t number = 0;
+  for (saidx_t c = 0; c < commandcount; c++) {
+	const struct reference_command *command = &commands[c];
+	if (!command->deleted)
+	  number++;
+	for (int k = 0; k < 3; k++)
+	  for (saidx_t j = command->starts[k];
+		   j < command->starts[k] + command->length; j++)
+		if (cover[j] == 1)
+		  parsed[j] = command->deleted ? 1 : number * 3 + k;
+  }
+
+  free(commands);
+  free(cover);
+  free(occurrences);
+  return number;
+
+oom:
+  free(commands);
+  free(cover);
+  free(occurrences);
+  return -2;
+}
+
+/* A differential test of the parsers against reference_parse: every engine
+   (and incremental reparsing) must give the same parsed, octet for octet,
+   and the same command count. The programs are every short string over two
+   and three octets, which puts commands at every edge of the suffix array and
+   the program that the window scan has boundary checks for; random strings
+   over alphabets of various sizes, long enough to go through the SIMD window
+   kernels; programs made of planted commands, some with overlapping
+   incidences; and edits of each random program, reparsed incrementally.
+   Each random program is also run with each kind of dispatch, to check
+   that they run it the same.
+
+   Build with -DTEST=2 (and -fopenmp, to test the parallel paths too), and
+   run with an optional random seed and count of random programs. */
+
+static const struct {
+  const char *name;
+  struct parse_options options;
+} test_engines[] = {
+  {"divsufsort (phi)", {ENGINE_DIVSUFSORT, LCP_PHI, 0, NULL}},
+  {"divsufsort (kasai)", {ENGINE_DIVSUFSORT, LCP_KASAI, 0, NULL}},
+  {"sais", {ENGINE_SAIS, LCP_PHI, 0, NULL}},
+  {"bwt", {ENGINE_BWT, LCP_PHI, 0, NULL}},
+};
+#define TEST_ENGINES (sizeof test_engines / sizeof *test_engines)
+
+static uint64_t test_state;
+
+static uint64_t
+test_random(uint64_t bound)
+{
+  test_state ^= test_state >> 12;
+  test_state ^= test_state << 25;
+  test_state ^= test_state >> 27;
+  return (test_state * UINT64_C(2685821657736338717) >> 11) % bound;
+}
+
+static void
+test_print_program(const sauchar_t *input, saidx_t inputlength)
+{
+  fputc('"', stderr);
+  for (saidx_t i = 0; i < inputlength; i++) {
+	if (input[i] >= ' ' && input[i] <= '~' && input[i] != '"' &&
+		input[i] != '\\')
+	  fputc(input[i], stderr);
+	else
+	  fprintf(stderr, "\\x%02x", input[i]);
+  }
+  fprintf(stderr, "\" (%" PRIdSAIDX_T " octets)\n", inputlength);
+}
+
+/* Compares a parser's output with the reference's, reporting the first
+   difference. Returns false if they differ. */
+static bool
+test_compare(const char *name, const sauchar_t *input, saidx_t inputlength,
+			 const saidx_t *expected, saidx_t expectedcount,
+			 const saidx_t *parsed, saidx_t commandcount)
+{
+  saidx_t i = 0;
+  while (i < inputlength && parsed[i] == expected[i])
+	i++;
+  if (commandcount == expectedcount && i == inputlength)
+	return true;
+
+  fprintf(stderr, "%s differs from the reference parser on ", name);
+  test_print_program(input, inputlength);
+  if (commandcount != expectedcount)
+	fprintf(stderr, "  %" PRIdSAIDX_T " commands, not %" PRIdSAIDX_T "\n",
+			commandcount, expectedcount);
+  if (i < inputlength)
+	fprintf(stderr, "  at octet %" PRIdSAIDX_T ": %" PRIdSAIDX_T
+			", not %" PRIdSAIDX_T "\n", i, parsed[i], expected[i]);
+  return false;
+}
+
+/* Parses a program with the reference parser and every engine (continuing
+   with context, if it isn't NULL). Returns false on any difference. */
+static bool
+test_program(const sauchar_t *input, saidx_t inputlength,
+			 struct parse_context *context)
+{
+  saidx_t *expected = malloc((inputlength + 1) * sizeof *expected);
+  saidx_t *parsed = malloc((inputlength + 1) * sizeof *parsed);
+  bool same = expected && parsed;
+  saidx_t expectedcount = same ?
+	reference_parse(input, expected, inputlength) : -2;
+  if (expectedcount < 0) {
+	perror("could not allocate memory");
+	exit(71);
+  }
+
+  for (size_t e = 0; same && e < TEST_ENGINES; e++)
+	same = test_compare(test_engines[e].name, input, inputlength,
+						expected, expectedcount, parsed,
+						lexical_parse(input, parsed, inputlength,
+									  &test_engines[e].options));
+  if (same && context)
+	same = test_compare("lexical_reparse", input, inputlength,
+						expected, expectedcount, parsed,
+						lexical_reparse(context, input, parsed,
+										inputlength));
+  free(parsed);
+  free(expected);
+  return same;
+}
+
+/* Runs a program (whole, and as fragments) with each kind of dispatch
+   (native code included, where there is any), on the same random input and
+   with limits small enough that it stops. Returns false if the runs differ
+   in their status, output or counts. */
+static bool
+test_dispatch(const sauchar_t *input, saidx_t inputlength)
+{
+  sauchar_t runinput[16], output[3][64];
+  for (size_t i = 0; i < sizeof runinput; i++)
+	runinput[i] = test_random(256);
+
+  for (int fragmented = 0; fragmented <= 1; fragmented++) {
+	struct incident_compile_options compile = {.fragmented = fragmented};
+	enum incident_status status[3];
+	struct incident_program *program =
+	  incident_compile(input, inputlength, &compile, &status[0]);
+	if (!program) {
+	  perror("could not allocate memory");
+	  exit(71);
+	}
+	struct incident_io io[3];
+	struct incident_counts counts[3];
+	for (int d = 0; d < 3; d++) {
+	  struct incident_run_options options = {
+		.maxsteps = 20000,
+		.maxmemory = 256,
+		.dispatch = d,
+	  };
+	  io[d] = (struct incident_io){
+		.input = runinput, .inputlen = sizeof runinput,
+		.output = output[d], .outputlen = sizeof output[d],
+	  };
+	  status[d] = incident_run(program, &io[d], &options, &counts[d]);
+	}
+	incident_free(program);
+
+	/* (Comparing each with the switch.) */
+	for (int d = 0; d < 2; d++) {
+	  if (status[d] != status[2] || io[d].inputused != io[2].inputused ||
+		  io[d].outputused != io[2].outputused ||
+		  memcmp(output[d], output[2], io[d].outputused) ||
+		  memcmp(&counts[d], &counts[2], sizeof *counts)) {
+		fprintf(stderr, "%s dispatch runs differently%s on ",
+				d ? "threaded" : "native", fragmented ? " (fragmented)" : "");
+		test_print_program(input, inputlength);
+		fprintf(stderr, "  status %d, not %d; %" PRIu64 " steps, not %"
+				PRIu64 "\n", (int)status[d], (int)status[2], counts[d].steps,
+				counts[2].steps);
+		return false;
+	  }
+	}
+  }
+  return true;
+}
+
+/* Writes a random program of planted commands (as in bench.c, but small):
+   random tokens, each written three times with up to three octets of random
+   filler before each incidence, a quarter of them starting with the end of
+   the token before (so that their incidences can overlap). Returns its
+   length. */
+static saidx_t
+test_planted_program(sauchar_t *program, saidx_t size, int alphabet)
+{
+  saidx_t length = 0, tokenlength = 2 + test_random(6);
+  sauchar_t token[8], last[8];
+  saidx_t lastlength = 0;
+  while (length + 3 * (tokenlength + 4) < size) {
+	for (saidx_t i = 0; i < tokenlength; i++)
+	  token[i] = 'a' + test_random(alphabet);
+	if (lastlength && test_random(4) == 0) {
+	  saidx_t shared = lastlength / 2 < tokenlength ? lastlength / 2
+		: tokenlength;
+	  memcpy(token, last + lastlength - shared, shared);
+	}
+	for (int k = 0; k < 3; k++) {
+	  for (saidx_t i = test_random(4); i > 0; i--)
+		program[length++] = 'a' + test_random(alphabet);
+	  memcpy(program + length, token, tokenlength);
+	  length += tokenlength;
+	}
+	memcpy(last, token, tokenlength);
+	lastlength = tokenlength;
+  }
+  return length;
+}
+
+int
+main(int argc, char **argv)
+{
+  test_state = argc > 1 ? strtoull(argv[1], NULL, 10) * 2 + 1 : 1;
+  long randomprograms = argc > 2 ? strtol(argv[2], NULL, 10) : 1000;
+  long programs = 0;
+  sauchar_t program[4096];
+
+  /* Every string over two octets up to length 12, and over three up to 8. */
+  for (int alphabet = 2; alphabet <= 3; alphabet++) {
+	for (saidx_t length = 0; length <= (alphabet == 2 ? 12 : 8); length++) {
+	  saidx_t strings = 1;
+	  for (saidx_t i = 0; i < length; i++)
+		strings *= alphabet;
+	  for (saidx_t s = 0; s < strings; s++, programs++) {
+		for (saidx_t i = 0, digits = s; i < length; i++, digits /= alphabet)
+		  program[i] = 'a' + digits % alphabet;
+		if (!test_program(program, length, NULL))
+		  return 1;
+	  }
+	}
+  }
+
+  /* Random programs, and edits of them, reparsed incrementally. */
+  static const int alphabets[] = {1, 2, 3, 4, 8, 26, 256};
+  struct parse_context *context = parse_context_new(NULL);
+  if (!context) {
+	perror("could not allocate memory");
+	return 71;
+  }
+  for (long p = 0; p < randomprograms; p++) {
+	int alphabet = alphabets[test_random(sizeof alphabets /
+										 sizeof *alphabets)];
+	saidx_t length;
+	if (p % 2) {
+	  length = test_planted_program(program, 64 + test_random(1024),
+									alphabet < 26 ? alphabet : 26);
+	} else {
+	  /* (Long runs of one octet are slow for reference_parse.) */
+	  length = test_random(p % 10 || alphabet == 1 ? 400 : 3000);
+	  for (saidx_t i = 0; i < length; i++)
+		program[i] = alphabet == 256 ? test_random(256) :
+		  'a' + test_random(alphabet);
+	}
+	if (!test_program(program, length, context) ||
+		!test_dispatch(program, length))
+	  return 1;
+	programs++;
+
+	/* A small edit: replace a few octets with a few others. */
+	saidx_t at = test_random(length + 1);
+	saidx_t removed = test_random(length - at < 8 ? length - at + 1 : 9);
+	saidx_t inserted = test_random(9);
+	memmove(program + at + inserted, program + at + removed,
+			length - at - removed);
+	for (saidx_t i = 0; i < inserted; i++)
+	  program[at + i] = alphabet == 256 ? test_random(256) :
+		'a' + test_random(alphabet);
+	length += inserted - removed;
+	if (!test_program(program, length, context))
+	  return 1;
+	programs++;
+  }
+  parse_context_free(context);
+
+  printf("%ld programs parsed the same by the reference and all %d "
+		 "engines, and %ld run the same with each dispatch\n", programs,
+		 (int)TEST_ENGINES, randomprograms);
+  return 0;
+}
+#endif
+
+/*** End of inlined file: parse.c ***/
+
+
+/*** Start of inlined file: utils.c ***/
+//#include "incident.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void
+complain_program_too_large(const char *filename)
+{
+  fprintf(stderr, "%s: program too large for this build%s\n",
+		  filename ? filename : "standard input",
+		  sizeof (saidx_t) < 8 ? " (try incident64)" : "");
+}
+
+/* length is an out parameter in which the file's length is stored;
+   NULL filename slurps standard input; on error, prints an error
+   message to standard error and returns NULL, with an error code in
+   *length; otherwise, returns a malloc'ed array holding the file's
+   contents
+
+   A regular file is read in one go into a buffer sized from fstat;
+   anything else (such as a pipe) is read in chunks into a buffer that
+   doubles whenever it fills, and is trimmed to size at the end. */
+sauchar_t *
+malloc_slurp_file(const char *filename, saidx_t *length)
+{
+  FILE *infile = stdin;
+  if (filename) {
+	if (!((infile = fopen(filename, "rb")))) {
+	  perror(filename);
+	  *length = 66;
+	  return NULL;
+	}
+  }
+
+  /* Allocate room for the whole file, if we know its size, plus one octet
+	 so that one read both fills the buffer and sees the end of the file. */
+  saidx_t inputalloc = 65536;
+  struct stat st;
+  bool sized = !fstat(fileno(infile), &st) && S_ISREG(st.st_mode) &&
+	st.st_size > 0;
+  if (sized)
+	inputalloc = st.st_size >= SAIDX_MAX ? SAIDX_MAX : st.st_size + 1;
+
+  saidx_t inputlen = 0;
+  sauchar_t *input = malloc(inputalloc);
+  if (!input) {
+	perror("allocating memory");
+	*length = 71;
+	if (infile != stdin)
+	  fclose(infile);
+	return NULL;
+  }
+
+  /* Now slurp the input. */
+  for (;;) {
+	if (inputlen == inputalloc) {
+	  if (inputalloc == SAIDX_MAX) {
+		if (getc(infile) == EOF && !ferror(infile))
+		  break; /* exactly SAIDX_MAX octets long */
+		complain_program_too_large(filename);
+		*length = 65;
+		if (infile != stdin)
+		  fclose(infile);
+		free(input);
+		return NULL;
+	  }
+	  inputalloc = inputalloc > SAIDX_MAX / 2 ? SAIDX_MAX : inputalloc * 2;
+	  sauchar_t *newinput = realloc(input, inputalloc);
+	  if (!newinput) {
+		perror("allocating memory");
+		*length = 71;
+		if (infile != stdin)
+		  fclose(infile);
+		free(input);
+		return NULL;
+	  } else {
+		input = newinput;
+	  }
+	}
+
+	inputlen += fread(input + inputlen, 1, inputalloc - inputlen, infile);
+	if (ferror(infile)) {
+	  perror("reading input file");
+	  free(input);
+	  if (infile != stdin)
+		fclose(infile);
+	  *length = 66;
+	  return NULL;
+	}
+	if (feof(infile))
+	  break;
+  }
+
+  /* Give back the unused part of a buffer that grew by doubling. */
+  if (!sized && inputlen < inputalloc) {
+	sauchar_t *newinput = realloc(input, inputlen ? inputlen : 1);
+	if (newinput)
+	  input = newinput;
+  }
+
+  *length = inputlen;
+  if (infile != stdin)
+	fclose(infile);
+  return input;
+}
+
+/* Like malloc_slurp_file, but maps a regular file into memory (read-only)
+   rather than copying it, setting *mapped; the contents must be released
+   with unload_file either way. A mapped file that's truncated while in use
+   crashes the process, so a caller that expects the file to change under
+   it should use malloc_slurp_file instead. */
+const sauchar_t *
+load_file(const char *filename, saidx_t *length, bool *mapped)
+{
+  *mapped = false;
+  if (filename) {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+		st.st_size > 0) {
+	  if (st.st_size > SAIDX_MAX) {
+		complain_program_too_large(filename);
+		close(fd);
+		*length = 65;
+		return NULL;
+	  }
+	  void *contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	  close(fd);
+	  if (contents != MAP_FAILED) {
+		*length = st.st_size;
+		*mapped = true;
+		return contents;
+	  }
+	} else if (fd >= 0)
+	  close(fd);
+  }
+
+  /* Standard input, pipes, empty files, and files that can't be mapped
+	 (malloc_slurp_file reports the error if the file can't be opened). */
+  return malloc_slurp_file(filename, length);
+}
+
+void
+unload_file(const sauchar_t *contents, saidx_t length, bool mapped)
+{
+  if (mapped)
+	munmap((void *)contents, length);
+  else
+	free((void *)contents);
+}
+
+/*** End of inlined file: utils.c ***/
+
+
+/*** Start of inlined file: cache.c ***/
+//#include "incident.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A compiled image is everything main needs to run a program without parsing
+   it. The file is an image_header, then the transition table (post_pop0,
+   post_pop1 and post_push for each command from 0, command 0 being unused),
+   then the fragment entry points, then optionally the parsed program (which
+   only tracing needs), then the source itself. Images use the native byte
+   order and index width: they are a cache, not an interchange format.
+
+   The hash only picks the file name and rejects most other programs early;
+   FNV-1a collisions are easy to make, so an image is only used if its copy
+   of the source matches the program exactly. */
+#define IMAGE_MAGIC "INCIMG03"
+
+struct image_header {
+  char magic[8];
+  int64_t index_size; /* sizeof (saidx_t) */
+  uint64_t hash;      /* image_hash of the source */
+  int64_t inputlen;
+  int64_t commandcount;
+  int64_t anchor;
+  int64_t first_incidence;
+  int64_t entrycount;
+  int64_t fragmented;
+  int64_t has_parsed;
+};
+
+/* 64-bit FNV-1a hash of a program's source. */
+uint64_t
+image_hash(const sauchar_t *input, saidx_t inputlen)
+{
+  uint64_t hash = UINT64_C(0xcbf29ce484222325);
+  for (saidx_t i = 0; i < inputlen; i++) {
+	hash ^= input[i];
+	hash *= UINT64_C(0x100000001b3);
+  }
+  return hash;
+}
+
+/* Returns a malloc'ed path for the image of a program with the given hash in
+   the given cache directory (creating the directory if need be), or NULL
+   (having printed an error message) on failure. The name depends on
+   everything that changes the image's contents: -f mode links commands
+   differently, and the index width changes the layout. */
+char *
+cache_image_path(const char *cachedir, uint64_t hash, bool fragmented)
+{
+  if (mkdir(cachedir, 0777) && errno != EEXIST) {
+	perror(cachedir);
+	return NULL;
+  }
+
+  size_t pathlen = strlen(cachedir) + 40;
+  char *path = malloc(pathlen);
+  if (!path) {
+	perror("could not allocate memory");
+	return NULL;
+  }
+  snprintf(path, pathlen, "%s/%016" PRIx64 "%s-%d.img", cachedir, hash,
+		   fragmented ? "f" : "", (int)sizeof (saidx_t) * 8);
+  return path;
+}
+
+/* (Incidences are numbered as described for struct compiled_image.) */
+static bool
+image_incidence_valid(saidx_t incidence, saidx_t commandcount)
+{
+  return incidence == 0 ||
+	(incidence >= 4 && incidence >> 2 <= commandcount &&
+	 (incidence & 3) != 3);
+}
+
+/* Maps the image at path into memory and fills in image from it. Fails
+   (returning false) if there is no such image, if it was compiled from some
+   other source or for some other mode, if need_parsed is set but the image
+   has no parsed program, or if the image is damaged. */
+bool
+cache_load_image(const char *path, uint64_t hash, const sauchar_t *input,
+				 saidx_t inputlen, bool fragmented, bool need_parsed,
+				 struct compiled_image *image)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+	return false;
+
+  struct stat st;
+  if (fstat(fd, &st) ||
+	  st.st_size < (off_t)sizeof (struct image_header) + inputlen) {
+	close(fd);
+	return false;
+  }
+  size_t mappinglen = st.st_size;
+  void *mapping = mmap(NULL, mappinglen, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+	return false;
+
+  const struct image_header *header = mapping;
+  const saidx_t *table = (const saidx_t *)(header + 1);
+  size_t tablebytes = mappinglen - sizeof *header - inputlen;
+  size_t tablelen = tablebytes / sizeof (saidx_t);
+  const sauchar_t *source = (const sauchar_t *)mapping + mappinglen - inputlen;
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof header->magic) ||
+	  header->index_size != sizeof (saidx_t) || header->hash != hash ||
+	  header->inputlen != inputlen || header->fragmented != fragmented ||
+	  (need_parsed && !header->has_parsed) ||
+	  header->commandcount < 0 ||
+	  (uint64_t)header->commandcount >= tablelen / 3 ||
+	  header->entrycount < 0 ||
+	  (uint64_t)header->entrycount > tablelen ||
+	  tablebytes % sizeof (saidx_t) ||
+	  tablelen != (size_t)(header->commandcount + 1) * 3 +
+	  (size_t)header->entrycount +
+	  (header->has_parsed ? (size_t)inputlen : 0) ||
+	  memcmp(source, input, inputlen))
+	goto damaged;
+
+  saidx_t commandcount = header->commandcount;
+  image->inputlen = inputlen;
+  image->commandcount = commandcount;
+  image->anchor = header->anchor;
+  image->first_incidence = header->first_incidence;
+  image->transitions = table;
+  image->entrycount = header->entrycount;
+  image->entries = table + (commandcount + 1) * 3;
+  image->parsed = header->has_parsed ? image->entries + image->entrycount
+	: NULL;
+  image->fragmented = fragmented;
+  image->mapping = mapping;
+  image->mappinglen = mappinglen;
+
+  /* Everything the interpreter will index by must be in range. */
+  if (!image_incidence_valid(image->anchor, commandcount) ||
+	  (image->anchor && (image->anchor & 3) != 1) ||
+	  !image_incidence_valid(image->first_incidence, commandcount))
+	goto damaged;
+  for (saidx_t i = 0; i < (commandcount + 1) * 3; i++)
+	if (!image_incidence_valid(table[i], commandcount))
+	  goto damaged;
+  for (saidx_t i = 0; i < image->entrycount; i++)
+	if (image->entries[i] < 4 ||
+		!image_incidence_valid(image->entries[i], commandcount))
+	  goto damaged;
+  if (image->parsed)
+	for (saidx_t i = 0; i < inputlen; i++)
+	  if (image->parsed[i] < 0 ||
+		  (image->parsed[i] > 2 &&
+		   !image_incidence_valid(image->parsed[i], commandcount)))
+		goto damaged;
+
+  return true;
+
+damaged:
+  munmap(mapping, mappinglen);
+  image->mapping = NULL;
+  return false;
+}
+
+/* Writes image to path, via a temporary file so that concurrent runs never
+   see a partial image. Failure isn't fatal (the program can still run), so
+   this just prints a warning and returns false. */
+bool
+cache_store_image(const char *path, uint64_t hash, const sauchar_t *input,
+				  const struct compiled_image *image)
+{
+  size_t pathlen = strlen(path) + 8;
+  char *temppath = malloc(pathlen);
+  if (!temppath) {
+	perror("could not allocate memory");
+	return false;
+  }
+  snprintf(temppath, pathlen, "%sXXXXXX", path);
+  int fd = mkstemp(temppath);
+  if (fd >= 0) {
+	/* mkstemp makes the file private; give it the usual permissions. */
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+  }
+  FILE *out = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (!out) {
+	perror(temppath);
+	if (fd >= 0) {
+	  close(fd);
+	  remove(temppath);
+	}
+	free(temppath);
+	return false;
+  }
+
+  struct image_header header = {
+	.index_size = sizeof (saidx_t),
+	.hash = hash,
+	.inputlen = image->inputlen,
+	.commandcount = image->commandcount,
+	.anchor = image->anchor,
+	.first_incidence = image->first_incidence,
+	.entrycount = image->entrycount,
+	.fragmented = image->fragmented,
+	.has_parsed = image->parsed != NULL,
+  };
+  memcpy(header.magic, IMAGE_MAGIC, sizeof header.magic);
+
+  size_t tablelen = (size_t)(image->commandcount + 1) * 3;
+  bool ok = fwrite(&header, sizeof header, 1, out) == 1 &&
+	fwrite(image->transitions, sizeof (saidx_t), tablelen, out) == tablelen &&
+	fwrite(image->entries, sizeof (saidx_t), image->entrycount, out) ==
+	(size_t)image->entrycount &&
+	(!image->parsed ||
+	 fwrite(image->parsed, sizeof (saidx_t), image->inputlen, out) ==
+	 (size_t)image->inputlen) &&
+	fwrite(input, 1, image->inputlen, out) == (size_t)image->inputlen;
+  ok = !fclose(out) && ok;
+  if (!ok || rename(temppath, path)) {
+	perror(path);
+	remove(temppath);
+	free(temppath);
+	return false;
+  }
+
+  free(temppath);
+  return true;
+}
+
+/* Releases an image that cache_load_image mapped (images that were filled in
+   some other way don't own their memory, so this leaves them alone). */
+void
+cache_unload_image(struct compiled_image *image)
+{
+  if (image->mapping)
+	munmap(image->mapping, image->mappinglen);
+  image->mapping = NULL;
+}
+
+/*** End of inlined file: cache.c ***/
+
+
+/*** Start of inlined file: sais.c ***/
+//#include "incident.h"
+
+#include <stdlib.h>
+
+/* An alternative to running divsufsort and then a separate LCP pass: suffix
+   array construction by induced sorting (SA-IS; Nong, Zhang, Chan 2009), with
+   the LCP array induced alongside the suffix array during the final induction
+   (following /Inducing the LCP-Array/, Fischer 2011).
+
+   Each time an induction places a suffix cX directly after another suffix cY
+   in bucket c, their LCP is 1 + the LCP of X and Y, which is a range minimum
+   over the part of the LCP array that the scan has already passed; a stack of
+   increasing LCP values answers those queries. The only LCP values that have
+   to be found by comparing characters are those between the L-type and S-type
+   parts of each bucket, which both start with a run of the bucket's
+   character; and those between LMS-suffixes, which are derived from the LCP
+   array of the reduced string that the recursion produces.
+
+   The top level works on octets; recursive levels on saidx_t names of LMS
+   substrings. cs says which. Suffixes are compared as if the input had a
+   sentinel character smaller than any other at the end. */
+
+#define SAIS_CHR(i) (cs == sizeof (saidx_t) ? ((const saidx_t *)T)[i] : \
+					 (saidx_t)((const sauchar_t *)T)[i])
+#define SAIS_TGET(i) ((types[(i) / 8] >> ((i) % 8)) & 1)
+#define SAIS_TSET(i, v) (types[(i) / 8] = (types[(i) / 8] & ~(1 << ((i) % 8))) | \
+						 ((v) << ((i) % 8)))
+#define SAIS_ISLMS(i) ((i) > 0 && SAIS_TGET(i) && !SAIS_TGET((i) - 1))
+
+/* LCP(x) is the LCP of the suffixes at SA[x - 1] and SA[x], for x > 0. */
+#define SAIS_LCP(x) (LCP[(x) - 1])
+#define SAIS_UNKNOWN (-1)
+
+/* Markers for "last suffix placed in this bucket was induced from": */
+#define SAIS_NONE (-2)     /* nothing placed in this bucket yet */
+#define SAIS_SENTINEL (-1) /* the (virtual) empty suffix */
+
+struct sais_stack {
+  struct { saidx_t pos, val; } *entries;
+  saidx_t len, alloc;
+};
+
+/* Push an LCP value; entries are kept strictly increasing in value. */
+static bool
+sais_stack_push(struct sais_stack *stack, saidx_t pos, saidx_t val)
+{
+  while (stack->len && stack->entries[stack->len - 1].val >= val)
+	stack->len--;
+  if (stack->len == stack->alloc) {
+	saidx_t newalloc = stack->alloc * 2 + 64;
+	void *newentries = realloc(stack->entries,
+							   newalloc * sizeof *stack->entries);
+	if (!newentries)
+	  return false;
+	stack->entries = newentries;
+	stack->alloc = newalloc;
+  }
+  stack->entries[stack->len].pos = pos;
+  stack->entries[stack->len].val = val;
+  stack->len++;
+  return true;
+}
+
+/* The minimum of the values pushed at positions that are at least (if
+   ascending) or at most (if !ascending) bound. There must be at least one. */
 static saidx_t
-find_commands_and_incidences(
-  const sauchar_t *restrict input, const saidx_t *restrict suffixarray,
-  const saidx_t *restrict lcparray,
-  struct incidence *restrict incidences, saidx_t inputlength)
+sais_stack_min(const struct sais_stack *stack, saidx_t bound, bool ascending)
+{
+  saidx_t lo = 0, hi = stack->len - 1;
+  while (lo < hi) {
+	saidx_t mid = lo + (hi - lo) / 2;
+	saidx_t pos = stack->entries[mid].pos;
+	if (ascending ? pos >= bound : pos <= bound)
+	  hi = mid;
+	else
+	  lo = mid + 1;
+  }
+  return stack->entries[lo].val;
+}
+
+static saidx_t
+sais_naive_lcp(const void *T, int cs, saidx_t n, saidx_t a, saidx_t b)
+{
+  saidx_t h = 0;
+  while (a + h < n && b + h < n && SAIS_CHR(a + h) == SAIS_CHR(b + h))
+	h++;
+  return h;
+}
+
+/* Sets B to the start (or one past the end) of each bucket. */
+static void
+sais_buckets(const saidx_t *C, saidx_t *B, saidx_t k, bool end)
+{
+  saidx_t sum = 0;
+  for (saidx_t c = 0; c < k; c++) {
+	sum += C[c];
+	B[c] = end ? sum : sum - C[c];
+  }
+}
+
+/* Plain induced sorting, for sorting LMS substrings. */
+static void
+sais_induce(const void *T, int cs, saidx_t *SA, const unsigned char *types,
+			const saidx_t *C, saidx_t *B, saidx_t n, saidx_t k)
+{
+  sais_buckets(C, B, k, false);
+  SA[B[SAIS_CHR(n - 1)]++] = n - 1;
+  for (saidx_t i = 0; i < n; i++) {
+	saidx_t j = SA[i] - 1;
+	if (j >= 0 && !SAIS_TGET(j))
+	  SA[B[SAIS_CHR(j)]++] = j;
+  }
+
+  sais_buckets(C, B, k, true);
+  for (saidx_t i = n - 1; i >= 0; i--) {
+	saidx_t j = SA[i] - 1;
+	if (j >= 0 && SAIS_TGET(j))
+	  SA[--B[SAIS_CHR(j)]] = j;
+  }
+}
+
+/* The final induction: SA holds the sorted LMS-suffixes at the ends of their
+   buckets, and LCP the LCP of each with the one before it (or SAIS_UNKNOWN
+   for the first in each bucket). Sorts all the suffixes and fills in LCP.
+   Returns 0 on success, -2 on allocation failure. */
+static saint_t
+sais_induce_lcp(const void *T, int cs, saidx_t *SA, saidx_t *LCP,
+				const unsigned char *types, const saidx_t *C, saidx_t *B,
+				saidx_t *last, saidx_t n, saidx_t k)
+{
+  struct sais_stack stack = {NULL, 0, 0};
+
+  /* L-type suffixes, left to right. The values on the stack are the LCP of
+	 each suffix placed so far with the previous one placed. */
+  sais_buckets(C, B, k, false);
+  for (saidx_t c = 0; c < k; c++)
+	last[c] = SAIS_NONE;
+
+  saidx_t p = B[SAIS_CHR(n - 1)]++;
+  SA[p] = n - 1;
+  if (p > 0)
+	SAIS_LCP(p) = 0; /* it's just one character, so first in its bucket */
+  last[SAIS_CHR(n - 1)] = SAIS_SENTINEL;
+
+  saidx_t previous = -1;
+  for (saidx_t i = 0; i < n; i++) {
+	if (SA[i] < 0)
+	  continue;
+
+	if (previous >= 0) {
+	  if (SAIS_LCP(i) == SAIS_UNKNOWN)
+		SAIS_LCP(i) = SAIS_CHR(SA[previous]) != SAIS_CHR(SA[i]) ? 0 :
+		  sais_naive_lcp(T, cs, n, SA[previous], SA[i]);
+	  if (!sais_stack_push(&stack, i, SAIS_LCP(i)))
+		goto oom;
+	}
+	previous = i;
+
+	saidx_t j = SA[i] - 1;
+	if (j < 0 || SAIS_TGET(j))
+	  continue;
+
+	saidx_t c = SAIS_CHR(j);
+	p = B[c]++;
+	SA[p] = j;
+	if (last[c] == SAIS_NONE)
+	  SAIS_LCP(p) = 0;
+	else if (last[c] == SAIS_SENTINEL)
+	  SAIS_LCP(p) = 1;
+	else
+	  SAIS_LCP(p) = 1 + sais_stack_min(&stack, last[c] + 1, true);
+	last[c] = i;
+  }
+
+  /* S-type suffixes, right to left. They overwrite the S-type part of every
+	 bucket (including the LMS-suffixes), so forget the LCP values there. */
+  for (saidx_t c = 0; c < k; c++)
+	B[c] = 0;
+  for (saidx_t i = 0; i < n; i++)
+	if (SAIS_TGET(i))
+	  B[SAIS_CHR(i)]++;
+  saidx_t end = 0;
+  for (saidx_t c = 0; c < k; c++) {
+	end += C[c];
+	for (saidx_t x = end - B[c]; x < end; x++)
+	  if (x > 0)
+		SAIS_LCP(x) = SAIS_UNKNOWN;
+	last[c] = SAIS_NONE;
+  }
+  sais_buckets(C, B, k, true);
+
+  stack.len = 0;
+  for (saidx_t i = n - 1; i >= 0; i--) {
+	if (i + 1 < n) {
+	  if (SAIS_LCP(i + 1) == SAIS_UNKNOWN)
+		SAIS_LCP(i + 1) = SAIS_CHR(SA[i]) != SAIS_CHR(SA[i + 1]) ? 0 :
+		  sais_naive_lcp(T, cs, n, SA[i], SA[i + 1]);
+	  if (!sais_stack_push(&stack, i + 1, SAIS_LCP(i + 1)))
+		goto oom;
+	}
+
+	saidx_t j = SA[i] - 1;
+	if (j < 0 || !SAIS_TGET(j))
+	  continue;
+
+	saidx_t c = SAIS_CHR(j);
+	p = --B[c];
+	SA[p] = j;
+	if (last[c] != SAIS_NONE)
+	  SAIS_LCP(p + 1) = 1 + sais_stack_min(&stack, last[c], false);
+	last[c] = i;
+  }
+
+  free(stack.entries);
+  return 0;
+
+oom:
+  free(stack.entries);
+  return -2;
+}
+
+/* Sorts the suffixes of T[0..n-1] (an alphabet of k characters) into SA and
+   their LCP values into LCP (n elements; LCP[i] compares SA[i] and SA[i + 1],
+   and the last element is scratch). Returns 0 on success, -2 on allocation
+   failure. */
+static saint_t
+sais_main(const void *T, int cs, saidx_t *SA, saidx_t *LCP,
+		  saidx_t n, saidx_t k)
+{
+  if (n <= 1) {
+	if (n == 1)
+	  SA[0] = 0;
+	return 0;
+  }
+
+  unsigned char *types = calloc(n / 8 + 1, 1);
+  saidx_t *C = malloc(3 * (size_t)k * sizeof *C);
+  if (!types || !C) {
+	free(types);
+	free(C);
+	return -2;
+  }
+  saidx_t *B = C + k, *last = B + k;
+
+  /* Classify the suffixes (S = 1, L = 0) and count the characters. */
+  for (saidx_t c = 0; c < k; c++)
+	C[c] = 0;
+  SAIS_TSET(n - 1, 0);
+  C[SAIS_CHR(n - 1)]++;
+  for (saidx_t i = n - 2; i >= 0; i--) {
+	saidx_t c0 = SAIS_CHR(i), c1 = SAIS_CHR(i + 1);
+	SAIS_TSET(i, c0 < c1 || (c0 == c1 && SAIS_TGET(i + 1)));
+	C[c0]++;
+  }
+
+  /* Stage 1: sort the LMS substrings. */
+  sais_buckets(C, B, k, true);
+  for (saidx_t i = 0; i < n; i++)
+	SA[i] = -1;
+  for (saidx_t i = 1; i < n; i++)
+	if (SAIS_ISLMS(i))
+	  SA[--B[SAIS_CHR(i)]] = i;
+  sais_induce(T, cs, SA, types, C, B, n, k);
+
+  /* Compact them into SA[0..m-1], then name them, storing the name of the
+	 substring at position i in SA[m + i / 2] (LMS positions are at least two
+	 apart). */
+  saidx_t m = 0;
+  for (saidx_t i = 0; i < n; i++)
+	if (SAIS_ISLMS(SA[i]))
+	  SA[m++] = SA[i];
+  for (saidx_t i = m; i < n; i++)
+	SA[i] = -1;
+
+  saidx_t names = 0, prev = -1;
+  for (saidx_t i = 0; i < m; i++) {
+	saidx_t pos = SA[i];
+	bool diff = false;
+	for (saidx_t d = 0;; d++) {
+	  if (prev < 0 || pos + d == n || prev + d == n ||
+		  SAIS_CHR(pos + d) != SAIS_CHR(prev + d) ||
+		  SAIS_TGET(pos + d) != SAIS_TGET(prev + d)) {
+		diff = true;
+		break;
+	  }
+	  if (d > 0 && (SAIS_ISLMS(pos + d) || SAIS_ISLMS(prev + d)))
+		break;
+	}
+	if (diff) {
+	  names++;
+	  prev = pos;
+	}
+	SA[m + pos / 2] = names - 1;
+  }
+  for (saidx_t i = n - 1, j = n - 1; i >= m; i--)
+	if (SA[i] >= 0)
+	  SA[j--] = SA[i];
+
+  /* Stage 2: sort the reduced string s1 (which is at the end of SA), giving
+	 the order of the LMS-suffixes in SA[0..m-1] and their LCPs, measured in
+	 LMS substrings, in LCP[0..m-2]. */
+  saidx_t *s1 = SA + n - m;
+  if (names < m) {
+	saint_t rv = sais_main(s1, sizeof (saidx_t), SA, LCP, m, names);
+	if (rv < 0) {
+	  free(types);
+	  free(C);
+	  return rv;
+	}
+  } else {
+	for (saidx_t i = 0; i < m; i++)
+	  SA[s1[i]] = i;
+	for (saidx_t i = 0; i + 1 < m; i++)
+	  LCP[i] = 0;
+  }
+
+  /* Replace s1 with the text positions of the LMS-suffixes, then convert
+	 the LCPs into characters: equal names mean equal substrings, and the
+	 first unequal substrings are compared directly. */
+  for (saidx_t i = n - 1, j = m; i > 0; i--)
+	if (SAIS_ISLMS(i))
+	  s1[--j] = i;
+  for (saidx_t i = 0; i + 1 < m; i++) {
+	saidx_t a = SA[i], b = SA[i + 1], h = LCP[i];
+	saidx_t offset = (a + h < m ? s1[a + h] : n) - s1[a];
+	LCP[i] = offset +
+	  sais_naive_lcp(T, cs, n, s1[a] + offset, s1[b] + offset);
+  }
+  for (saidx_t i = 0; i < m; i++)
+	SA[i] = s1[SA[i]];
+  for (saidx_t i = m; i < n; i++)
+	SA[i] = -1;
+
+  /* Stage 3: put the sorted LMS-suffixes at the ends of their buckets, then
+	 induce everything else. */
+  sais_buckets(C, B, k, true);
+  for (saidx_t i = m - 1; i >= 0; i--) {
+	saidx_t j = SA[i];
+	saidx_t c = SAIS_CHR(j);
+	SA[i] = -1;
+	saidx_t p = --B[c];
+	SA[p] = j;
+	if (p > 0)
+	  SAIS_LCP(p) = i > 0 && SAIS_CHR(SA[i - 1]) == c ? LCP[i - 1]
+		: SAIS_UNKNOWN;
+  }
+  saint_t rv = sais_induce_lcp(T, cs, SA, LCP, types, C, B, last, n, k);
+
+  free(types);
+  free(C);
+  return rv;
+}
+
+/* Builds the suffix array and LCP array of an input string together, in the
+   same format that suffixlcp produces. Returns 0 on success, -2 on allocation
+   failure. */
+saint_t
+sais_lcp(const sauchar_t *T, saidx_t *SA, saidx_t *LCP, saidx_t n)
+{
+  return sais_main(T, sizeof (sauchar_t), SA, LCP, n, UINT8_MAX + 1);
+}
+
+#undef SAIS_CHR
+#undef SAIS_TGET
+#undef SAIS_TSET
+#undef SAIS_ISLMS
+#undef SAIS_LCP
+#undef SAIS_UNKNOWN
+#undef SAIS_NONE
+#undef SAIS_SENTINEL
+
+/*** End of inlined file: sais.c ***/
+
+
+/*** Start of inlined file: fmindex.c ***/
+//#include "incident.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A parse engine that needs less memory than a suffix array and an LCP array
+   together. It finds the provisional commands in a compressed index of the
+   program instead: the Burrows-Wheeler transform (BWT), held in
+   a wavelet matrix, and a suffix array sampled at every FM_SAMPLE_RATE-th
+   text position.
+
+   A provisional command is a string with exactly three incidences that is
+   right-maximal (its incidences are followed by at least two different
+   octets, or the end of the program) and left-maximal (likewise for the
+   octets before them). With a sentinel row for the empty suffix, the rows of
+   the BWT matrix that start with a string w form an interval; the windows
+   that the LCP scan in parse.c looks for are exactly the intervals of three
+   rows that belong to right-maximal strings. So we enumerate the right-maximal
+   strings, each with the partition of its interval into the intervals of its
+   one-octet right extensions (its "children"), starting from the empty
+   string. Extending w to the left by an octet c maps each child's interval to
+   the corresponding child's interval of cw, via rank queries for c over the
+   BWT; cw is right-maximal if it has two or more non-empty children. Every
+   suffix of a right-maximal string is right-maximal, so this reaches all of
+   them, and each only once. A left extension never has more rows than the
+   string it extends, so strings with fewer than three rows need not be
+   extended further; and w is left-maximal if its rows of the BWT are not all
+   the same octet.
+
+   A command's depth in this search is its length, and its first row is its
+   position in the suffix array, so the commands come out in the same order
+   as from the LCP scan once sorted by row. Only their starts need the
+   sampled suffix array, which is walked back from each row by LF-mapping
+   until it reaches a sampled text position.
+
+   Building the index needs a suffix array, which lives in parsed; the BWT and
+   the wavelet matrix's working copies of it overwrite that in turn, and
+   parsed then holds the commands found. Beyond parsed, the index takes about
+   1 + 1/7 octets per octet of program for the wavelet matrix, and 1/7 + 4 /
+   FM_SAMPLE_RATE (or 8 / FM_SAMPLE_RATE with 64-bit indices) for the
+   samples.
+
+   parsed has to be held for the output anyway, so building the BWT without
+   a suffix array would save nothing: the peak is the program, parsed and
+   the index, about 5.5 octets per octet of program with 32-bit indices
+   (plus the incidences), against 8 for the other engines. That makes room
+   for programs about half as large again, not several times as large. The
+   price is the search, which makes up to 16 rank queries (two per level of
+   the wavelet matrix) for each child of each right-maximal string, each
+   likely a cache miss, where the LCP scan reads memory in order. It takes
+   hundreds of times as long as the scan (4.5 s against 0.02 s for 4 MiB of
+   synthetic program), and the whole parse several times as long. */
+
+#define FM_SAMPLE_RATE 32
+
+/* Bit vectors with rank support. Each block of eight 64-bit words holds the
+   number of ones before the block, then FM_BLOCK_BITS bits, so that a rank
+   query touches a single cache line. */
+#define FM_BLOCK_BITS 448
+
+static inline unsigned
+fm_popcount(uint64_t x)
+{
+#if defined(__GNUC__)
+  return __builtin_popcountll(x);
+#else
+  x -= (x >> 1) & 0x5555555555555555u;
+  x = (x & 0x3333333333333333u) + ((x >> 2) & 0x3333333333333333u);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fu;
+  return (x * 0x0101010101010101u) >> 56;
+#endif
+}
+
+#if defined(__GNUC__)
+# define FM_PREFETCH(address) __builtin_prefetch(address)
+#else
+# define FM_PREFETCH(address) ((void)0)
+#endif
+
+/* Returns a bit vector of length bits, all clear, or NULL if memory could
+   not be allocated. */
+static uint64_t *
+fm_bits_new(saidx_t length)
+{
+  size_t size = ((size_t)length / FM_BLOCK_BITS + 1) * 8 * sizeof (uint64_t);
+  uint64_t *bits = aligned_alloc(64, size);
+  if (bits)
+	memset(bits, 0, size);
+  return bits;
+}
+
+static inline uint64_t *
+fm_bits_word(uint64_t *bits, saidx_t i)
+{
+  return &bits[i / FM_BLOCK_BITS * 8 + 1 + i % FM_BLOCK_BITS / 64];
+}
+
+static inline void
+fm_bits_set(uint64_t *bits, saidx_t i)
 {
-  saidx_t incidencecount = 0;
-  for (int i = 0; i < inputlength - 2; i++) {
-	/* To have exactly 3 incidences, the LCP array needs a pattern of
-	   (i-1) short, (i) long, (i+1) long, (i+2) short. "Out of bounds" in the
-	   LCP array is effectively the same as 0, so we have inputlength - 2
-	   positions (the LCP array has inputlength - 1 positions, and we
-	   subtract 1 because i+1 has to be inbounds too). */
-	saidx_t longerboundary = (i == 0 ? 0 : lcparray[i-1]);
-	if (i < inputlength - 3 && longerboundary < lcparray[i+2])
-	  longerboundary = lcparray[i+2];
-	saidx_t shorterinner = lcparray[i+1];
-	if (lcparray[i] < shorterinner)
-	  shorterinner = lcparray[i];
-
-	if (shorterinner <= longerboundary)
-	  continue;
+  *fm_bits_word(bits, i) |= (uint64_t)1 << (i % FM_BLOCK_BITS % 64);
+}
 
-	/* The substrings starting at suffixarray[i, i+1, i+2] with length
-	   shorterinner will all be identical (because their first shorterinner
-	   characters are identical via the definition of the LCP array), and there
-	   will be no other incidences of them (because such an incidence would have
-	   to appear next to the others in the suffix array, but the LCP array says
-	   that no more than longerboundary characters match at the start). We also
-	   know that the substring is not a prefix of a longer provisional command
-	   (because otherwise longerboundary would be higher). It might be a suffix
-	   of a longer provisional command, though; to discount this we need to look
-	   at the preceding characters in the input and make sure they aren't all
-	   the same. */
-	if (suffixarray[i] > 0 && suffixarray[i+1] > 0 && suffixarray[i+2] > 0 &&
-		input[suffixarray[i] - 1] == input[suffixarray[i+1] - 1] &&
-		input[suffixarray[i] - 1] == input[suffixarray[i+2] - 1])
-	  continue;
+static inline bool
+fm_bits_get(const uint64_t *bits, saidx_t i)
+{
+  return (*fm_bits_word((uint64_t *)bits, i) >>
+		  (i % FM_BLOCK_BITS % 64)) & 1;
+}
 
-	/* OK, it's definitely a provisional command. Record it. */
-	incidences[incidencecount++] =
-	  (struct incidence){.start = suffixarray[i],   .length = shorterinner};
-	incidences[incidencecount++] =
-	  (struct incidence){.start = suffixarray[i+1], .length = shorterinner};
-	incidences[incidencecount++] =
-	  (struct incidence){.start = suffixarray[i+2], .length = shorterinner};
+/* Fills in the block counts, once all the bits are set. */
+static void
+fm_bits_finish(uint64_t *bits, saidx_t length)
+{
+  uint64_t total = 0;
+  for (saidx_t block = 0; block <= length / FM_BLOCK_BITS; block++) {
+	uint64_t *words = &bits[block * 8];
+	words[0] = total;
+	for (int w = 1; w < 8; w++)
+	  total += fm_popcount(words[w]);
   }
+}
 
-  return incidencecount / 3; /* no way to fail */
+/* The number of ones before position i (which may be the length). */
+static inline saidx_t
+fm_bits_rank(const uint64_t *bits, saidx_t i)
+{
+  const uint64_t *words = &bits[i / FM_BLOCK_BITS * 8];
+  saidx_t offset = i % FM_BLOCK_BITS;
+  saidx_t rank = words[0];
+  for (saidx_t w = 1; w <= offset / 64; w++)
+	rank += fm_popcount(words[w]);
+  if (offset % 64)
+	rank += fm_popcount(words[offset / 64 + 1] &
+						(((uint64_t)1 << (offset % 64)) - 1));
+  return rank;
 }
 
-/* Parses the input as an Incident program. The input is a sequence of
-   octets in (input, inputlength). The output lists a lexical category
-   for each octet of the input:
+struct fmindex {
+  /* The wavelet matrix: one bit vector per bit of the octets, most
+	 significant first. Each level stably sorts the sequence by that level's
+	 bit, zeros first, for the next. */
+  uint64_t *levels[8];
+  saidx_t zeros[8];
+  saidx_t start[256];   /* where each octet's run starts after level 7 */
 
-   0 - not part of an incidence of a command or provisional command
-   1 - part of an incidence of one non-command provisional command
-   2 - part of an incidence of multiple provisional commands
+  saidx_t firsts[256];  /* first row starting with each octet */
+  saidx_t sentinel;     /* the row of the whole program, whose BWT octet is
+						   the sentinel (and isn't in the wavelet matrix) */
 
-   Higher numbers represent incidences of (non-provisional) commands.
-   These use arbitrary numbers >= 2, but incidences of the same command
-   will have the same value / 3, and the value % 3 gives the position:
+  uint64_t *sampled;    /* rows whose text position is sampled */
+  saidx_t *samples;     /* and those positions, in row order */
+};
 
-   0 - first incidence;
-   1 - middle incidence;
-   2 - last incidence.
+static void
+fmindex_free(struct fmindex *index)
+{
+  for (int level = 0; level < 8; level++)
+	free(index->levels[level]);
+  free(index->sampled);
+  free(index->samples);
+}
 
-   Returns the number of non-provisional commands seen on success, negative on
-   failure. */
-saint_t
-lexical_parse(const sauchar_t *restrict input, saidx_t *restrict parsed,
-			  saidx_t inputlength)
+/* Builds the wavelet matrix over the length octets at sequence, using as
+   many octets at scratch. Returns false if memory could not be
+   allocated. */
+static bool
+fmindex_build_wavelet(struct fmindex *index, sauchar_t *sequence,
+					  sauchar_t *scratch, saidx_t length)
 {
-  /* Initialize the output to all zeroes. */
-  for (saidx_t i = 0; i < inputlength; i++)
-	parsed[i] = 0;
+  for (int level = 0; level < 8; level++) {
+	uint64_t *bits = index->levels[level] = fm_bits_new(length);
+	if (!bits)
+	  return false;
+	int shift = 7 - level;
+	saidx_t zeros = 0;
+	for (saidx_t i = 0; i < length; i++) {
+	  if ((sequence[i] >> shift) & 1)
+		fm_bits_set(bits, i);
+	  else
+		zeros++;
+	}
+	fm_bits_finish(bits, length);
+	index->zeros[level] = zeros;
 
-  /* Special case: very short inputs can't go through the normal codepaths
-	 because the VLAs would be too small, but they also can't contain any
-	 even provisional commands and thus are trivial to parse. */
-  if (inputlength < 3)
+	saidx_t nextzero = 0, nextone = zeros;
+	for (saidx_t i = 0; i < length; i++) {
+	  if ((sequence[i] >> shift) & 1)
+		scratch[nextone++] = sequence[i];
+	  else
+		scratch[nextzero++] = sequence[i];
+	}
+	sauchar_t *swap = sequence;
+	sequence = scratch;
+	scratch = swap;
+  }
+
+  for (int c = 0; c < 256; c++) {
+	saidx_t i = 0;
+	for (int level = 0; level < 8; level++) {
+	  saidx_t ones = fm_bits_rank(index->levels[level], i);
+	  i = (c >> (7 - level)) & 1 ? index->zeros[level] + ones : i - ones;
+	}
+	index->start[c] = i;
+  }
+  return true;
+}
+
+/* A run of one octet within a range of the BWT: the octet's rank at either
+   end of the range. */
+struct fm_symbolrange {
+  sauchar_t symbol;
+  saidx_t from, to;
+};
+
+/* Lists the distinct octets in positions [from, to) of the wavelet
+   matrix's sequence, in increasing order, with their ranks at either end.
+   Returns how many there are. */
+static int
+fm_symbol_ranges(const struct fmindex *index, int level, unsigned prefix,
+				 saidx_t from, saidx_t to, struct fm_symbolrange *out)
+{
+  if (from == to)
 	return 0;
+  if (level == 8) {
+	out->symbol = prefix;
+	out->from = from - index->start[prefix];
+	out->to = to - index->start[prefix];
+	return 1;
+  }
+  const uint64_t *bits = index->levels[level];
+  saidx_t onesfrom = fm_bits_rank(bits, from);
+  saidx_t onesto = to - from == 1 ? onesfrom + fm_bits_get(bits, from) :
+	fm_bits_rank(bits, to);
+  int count = fm_symbol_ranges(index, level + 1, prefix << 1,
+							   from - onesfrom, to - onesto, out);
+  return count + fm_symbol_ranges(index, level + 1, prefix << 1 | 1,
+								  index->zeros[level] + onesfrom,
+								  index->zeros[level] + onesto, out + count);
+}
 
-  saidx_t suffixarray[inputlength];
-  saidx_t lcparray[inputlength - 1];
-  struct incidence incidences[inputlength];
+/* Replaces the start of each of count incidences, which must be a row of
+   the BWT (other than the empty suffix's), with the text position of the
+   suffix at that row.
 
-  /* Find the commands and their incidences. */
-  saint_t rv = suffixlcp(input, suffixarray, lcparray, inputlength);
-  if (rv < 0)
-	return rv;
-  saidx_t commands = find_commands_and_incidences(
-	input, suffixarray, lcparray, incidences, inputlength);
+   Each walk back to a sampled row is a chain of dependent cache misses, one
+   per level of the wavelet matrix per step, so FM_LOCATE_BATCH walks are
+   interleaved, each prefetching the cache line for its next step while the
+   others take theirs. */
+#define FM_LOCATE_BATCH 32
+static void
+fm_locate(const struct fmindex *index, struct incidence *incidences,
+		  saidx_t count)
+{
+  struct {
+	saidx_t incidence;
+	saidx_t row;
+	saidx_t steps;
+	saidx_t i;         /* position in the current level */
+	int level;         /* or -1 to check whether row is sampled */
+	unsigned symbol;   /* the bits of the octet seen so far */
+  } walks[FM_LOCATE_BATCH];
+  int active = 0;
+  saidx_t next = 0;
+
+  while (active || next < count) {
+	while (active < FM_LOCATE_BATCH && next < count) {
+	  walks[active].incidence = next;
+	  walks[active].row = incidences[next++].start;
+	  walks[active].steps = 0;
+	  walks[active].level = -1;
+	  active++;
+	}
 
-  /* Record a mapping between "old" and "new" command numbers. "old" number =
-	 key = location in the incidences array divided by 3. "new" number = value =
-	 0 for deleted, 1 for "value hasn't been determined yet", otherwise a
-	 nonzero multiple of 3 with an adjustment:
-	 -1: no incidences processed yet;
-	 +0: first  incidence is being processed or has been processed;
-	 +1: second incidence is being processed or has been processed;
-	 +2: third  incidence is being processed or has been processed */
-  saidx_t newnumbers[commands < 1 ? 1 : commands];
-
-  /* Loop over the incidences, marking them in parsed as we go. A 0 gets
-	 converted to a temporary new command number, equal to the old command
-	 number plus 1 times 3 (plus 1 if it's the first octet of the incidence;
-	 this allows us to distinguish between two identical incidences).  Anything
-	 that's already nonzero gets converted to 2 (to mark that this is where an
-	 overlap occurred). */
-  for (saidx_t i = 0; i < commands * 3; i++) {
-	unsigned old_command_number = i / 3;
-
-	if (!(i % 3))
-	  newnumbers[old_command_number] = old_command_number + 1;
-
-	for (saidx_t j = incidences[i].start;
-		 j < incidences[i].start + incidences[i].length; j++) {
-	  if (parsed[j]) {
-		/* The overlap deletes both overlapping commands; this one is
-		   old_command_number; the other might be parsed[j] / 3 - 1, or might be
-		   a command that's been deleted already. */
-		if (parsed[j] != 2)
-		  newnumbers[parsed[j] / 3 - 1] = 0;
-		newnumbers[old_command_number] = 0;
-		parsed[j] = 2;
+	for (int w = 0; w < active; w++) {
+	  saidx_t row = walks[w].row;
+	  if (walks[w].level < 0) {
+		if (fm_bits_get(index->sampled, row)) {
+		  incidences[walks[w].incidence].start =
+			index->samples[fm_bits_rank(index->sampled, row)] +
+			walks[w].steps;
+		  walks[w--] = walks[--active];
+		  continue;
+		}
+		walks[w].i = row - (row > index->sentinel);
+		walks[w].level = 0;
+		walks[w].symbol = 0;
+		FM_PREFETCH(fm_bits_word(index->levels[0], walks[w].i));
+		continue;
+	  }
+
+	  const uint64_t *bits = index->levels[walks[w].level];
+	  saidx_t i = walks[w].i;
+	  bool bit = fm_bits_get(bits, i);
+	  saidx_t ones = fm_bits_rank(bits, i);
+	  i = bit ? index->zeros[walks[w].level] + ones : i - ones;
+	  walks[w].symbol = walks[w].symbol << 1 | bit;
+	  if (++walks[w].level < 8) {
+		walks[w].i = i;
+		FM_PREFETCH(fm_bits_word(index->levels[walks[w].level], i));
 	  } else {
-		parsed[j] = (old_command_number + 1) * 3;
+		/* LF-mapping: on to the row of the suffix one octet longer. */
+		unsigned c = walks[w].symbol;
+		walks[w].row = index->firsts[c] + i - index->start[c];
+		walks[w].steps++;
+		walks[w].level = -1;
+		FM_PREFETCH(fm_bits_word(index->sampled, walks[w].row));
 	  }
 	}
-
-	if (parsed[incidences[i].start] > 2)
-	  parsed[incidences[i].start]++;
   }
+}
 
-  /* Assign arbitrary command numbers, keeping the numbers as low as
-	 possible. */
-  saidx_t newnumber = 2;
-  for (saidx_t i = 0; i < commands; i++) {
-	if (!newnumbers[i])
-	  continue;
-	newnumbers[i] = newnumber;
-	newnumber += 3;
-  }
+/* Builds the index of the input, using parsed (inputlength elements) as
+   scratch space. Returns 0 on success, negative on failure (-2 if memory
+   could not be allocated). */
+static saint_t
+fmindex_build(struct fmindex *index, const sauchar_t *input,
+			  saidx_t *parsed, saidx_t inputlength)
+{
+  saint_t rv = divsufsort(input, parsed, inputlength);
+  if (rv < 0)
+	return rv;
 
-  /* Now loop over the input, differentiating the three incidences of each
-	 command. */
-  for (saidx_t i = 0; i < inputlength; i++) {
-	if (parsed[i] < 3)
-	  continue; /* it's already correctly 0 or 2 */
+  index->sampled = fm_bits_new(inputlength + 1);
+  index->samples = malloc(((size_t)(inputlength - 1) / FM_SAMPLE_RATE + 1) *
+						  sizeof *index->samples);
+  if (!index->sampled || !index->samples)
+	return -2;
 
-	unsigned old_command_number = parsed[i] / 3 - 1;
-	if (!newnumbers[old_command_number]) {
-	  parsed[i] = 1; /* the command was deleted due to overlap */
-	  continue;
-	}
+  saidx_t counts[256] = {0};
+  for (saidx_t i = 0; i < inputlength; i++)
+	counts[input[i]]++;
+  saidx_t total = 1;
+  for (int c = 0; c < 256; c++) {
+	index->firsts[c] = total;
+	total += counts[c];
+  }
 
-	if (parsed[i] % 3) /* first octet of an instance */
-	  newnumbers[old_command_number]++; /* maintain the invariant */
-	parsed[i] = newnumbers[old_command_number];
+  /* Row 0 is the empty suffix; row r > 0 is suffix parsed[r - 1]. The BWT
+	 goes over the suffix array as it is read, which is safe because it is
+	 written no faster than one octet per element read. */
+  sauchar_t *bwt = (sauchar_t *)parsed;
+  saidx_t first = parsed[0];
+  saidx_t written = 0, samplecount = 0;
+  bwt[written++] = input[inputlength - 1];
+  for (saidx_t row = 1; row <= inputlength; row++) {
+	saidx_t position = row == 1 ? first : parsed[row - 1];
+	if (position % FM_SAMPLE_RATE == 0) {
+	  fm_bits_set(index->sampled, row);
+	  index->samples[samplecount++] = position;
+	}
+	if (position == 0)
+	  index->sentinel = row;
+	else
+	  bwt[written++] = input[position - 1];
   }
+  fm_bits_finish(index->sampled, inputlength + 1);
 
-  return newnumber / 3; /* remainder is necessarily 2 */
+  if (!fmindex_build_wavelet(index, bwt, bwt + inputlength, inputlength))
+	return -2;
+  return 0;
 }
 
-/* Given a parsed input program, returns the anchor command (as the incidence
-   number of the second incidence of the command). parsedlen is the number of
-   elements in parsed (i.e. the number of octets in the original program). */
+/* Finds the provisional commands of the input (at least 3 octets), and
+   allocates and fills *incidences with their incidences, in the same order
+   as find_commands_and_incidences in parse.c. parsed (inputlength elements)
+   is scratch space, left all zeroes on success. If stats isn't NULL, the
+   time taken goes in its sort (building the index) and scan (searching it)
+   fields.
+
+   Returns the number of provisional commands on success, negative on failure
+   (-2 if memory could not be allocated). */
 saidx_t
-anchor_command(saidx_t *parsed, saidx_t parsedlen)
+fmindex_commands(const sauchar_t *input, saidx_t *parsed,
+				 saidx_t inputlength, struct incidence **incidences,
+				 struct parse_stats *stats)
 {
-  /* First scan over the program: count the command incidences. */
-  saidx_t last_incidence = 0;
-  saidx_t incidence_count = 0;
-
-  for (saidx_t i = 0; i < parsedlen; i++) {
-	if (parsed[i] > 2 && parsed[i] != last_incidence) {
-	  last_incidence = parsed[i];
-	  incidence_count++;
-	}
+  struct fmindex index = {0};
+  saidx_t *stack = NULL;
+  saidx_t (*extensions)[258] = NULL;
+  double start = stats ? parse_clock() : 0;
+  saidx_t rv = fmindex_build(&index, input, parsed, inputlength);
+  if (rv < 0)
+	goto done;
+  if (stats) {
+	double now = parse_clock();
+	stats->sort = now - start;
+	start = now;
   }
 
-  if (incidence_count == 0)
-	return 0; /* no anchor command */
-
-  /* Second scan: find the centremost incidence. With 1 or 2 incidences, this
-	 is the first; with 3 or 4, this is the second; and so on. */
-  saidx_t target_incidence = (incidence_count - 1) / 2;
-  incidence_count = 0;
+  /* The search is depth-first, on a stack of right-maximal strings, each
+	 stored as the boundaries of its children, then the number of children,
+	 then its length. It extends the string with the most rows last, so a
+	 string whose other extensions are waiting on the stack is only being
+	 searched below if that part has at most half its rows; the stack thus
+	 holds the extensions of at most log2(inputlength) strings at once.
+	 extensions accumulates the boundaries of the children of each left
+	 extension of the string being extended. */
+  size_t stacksize = 0, stackalloc = 1024;
+  stack = malloc(stackalloc * sizeof *stack);
+  extensions = malloc(256 * sizeof *extensions);
+  if (!stack || !extensions) {
+	rv = -2;
+	goto done;
+  }
+  for (saidx_t i = 0; i < inputlength; i++)
+	parsed[i] = 0;
 
-  for (saidx_t i = 0; i < parsedlen; i++) {
-	if (parsed[i] > 2 && parsed[i] != last_incidence) {
-	  if (incidence_count == target_incidence) {
-		/* Be careful: this might be the first or third incidence. */
-		return (parsed[i] / 3) * 3 + 1;
+  /* The empty string: its children are the empty suffix, and the rows
+	 starting with each octet. */
+  stack[stacksize++] = 0;
+  stack[stacksize++] = 1;
+  for (int c = 0; c < 256; c++) {
+	saidx_t end = c == 255 ? inputlength + 1 : index.firsts[c + 1];
+	if (end > index.firsts[c])
+	  stack[stacksize++] = end;
+  }
+  saidx_t rootchildren = stacksize - 1;
+  stack[stacksize++] = rootchildren;
+  stack[stacksize++] = 0;
+
+  saidx_t lengths[256] = {0};
+  while (stacksize) {
+	saidx_t depth = stack[--stacksize];
+	saidx_t children = stack[--stacksize];
+	saidx_t boundaries[258];
+	stacksize -= children + 1;
+	memcpy(boundaries, &stack[stacksize], (children + 1) * sizeof *boundaries);
+	saidx_t from = boundaries[0], to = boundaries[children];
+
+	/* Extend each child to the left by each octet before it. */
+	sauchar_t symbols[256];
+	int symbolcount = 0;
+	for (saidx_t k = 0; k < children; k++) {
+	  struct fm_symbolrange ranges[256];
+	  int count = fm_symbol_ranges(
+		&index, 0, 0, boundaries[k] - (boundaries[k] > index.sentinel),
+		boundaries[k + 1] - (boundaries[k + 1] > index.sentinel), ranges);
+	  for (int r = 0; r < count; r++) {
+		sauchar_t c = ranges[r].symbol;
+		saidx_t *extension = extensions[c];
+		if (!lengths[c]) {
+		  symbols[symbolcount++] = c;
+		  extension[lengths[c]++] = index.firsts[c] + ranges[r].from;
+		}
+		extension[lengths[c]++] = index.firsts[c] + ranges[r].to;
 	  }
+	}
 
-	  last_incidence = parsed[i];
-	  incidence_count++;
+	/* Three rows that aren't all preceded by the same octet make a
+	   provisional command. Rows are 1-based suffix array indexes. */
+	if (depth > 0 && to - from == 3 &&
+		(symbolcount > 1 || (from <= index.sentinel && index.sentinel < to)))
+	  parsed[from - 1] = depth;
+
+	/* Push the right-maximal extensions with three or more rows, the one
+	   with the most rows first. */
+	int largest = -1;
+	saidx_t mostrows = 0;
+	for (int s = 0; s < symbolcount; s++) {
+	  saidx_t *extension = extensions[symbols[s]];
+	  saidx_t length = lengths[symbols[s]];
+	  saidx_t rows = extension[length - 1] - extension[0];
+	  if (length < 3 || rows < 3)
+		lengths[symbols[s]] = 0;
+	  else if (rows > mostrows) {
+		largest = s;
+		mostrows = rows;
+	  }
+	}
+	for (int pass = 0; pass < 2; pass++) {
+	  for (int s = 0; s < symbolcount; s++) {
+		saidx_t length = lengths[symbols[s]];
+		if (!length || (s == largest) == (pass == 1))
+		  continue;
+		if (stacksize + length + 2 > stackalloc) {
+		  saidx_t *newstack =
+			realloc(stack, stackalloc * 2 * sizeof *newstack);
+		  if (!newstack) {
+			rv = -2;
+			goto done;
+		  }
+		  stack = newstack;
+		  stackalloc *= 2;
+		}
+		for (saidx_t k = 0; k < length; k++)
+		  stack[stacksize++] = extensions[symbols[s]][k];
+		stack[stacksize++] = length - 1;
+		stack[stacksize++] = depth + 1;
+	  }
 	}
+	for (int s = 0; s < symbolcount; s++)
+	  lengths[symbols[s]] = 0;
+  }
+
+  /* Locate the commands' incidences, in suffix array order. */
+  saidx_t commands = 0;
+  for (saidx_t i = 0; i < inputlength; i++)
+	commands += parsed[i] != 0;
+  *incidences = malloc(((size_t)commands * 3 + 1) * sizeof **incidences);
+  if (!*incidences) {
+	rv = -2;
+	goto done;
   }
-  abort(); /* we missed it? */
+  for (saidx_t i = 0, c = 0; i < inputlength; i++) {
+	if (!parsed[i])
+	  continue;
+	for (int j = 0; j < 3; j++)
+	  (*incidences)[c++] =
+		(struct incidence){.start = i + 1 + j, .length = parsed[i]};
+	parsed[i] = 0;
+  }
+  fm_locate(&index, *incidences, commands * 3);
+  rv = commands;
+  if (stats)
+	stats->scan = parse_clock() - start;
+
+done:
+  free(extensions);
+  free(stack);
+  fmindex_free(&index);
+  return rv;
 }
 
-#if defined(TEST) && TEST == 1
-int
-main(void)
-{
-  const sauchar_t testinput[] =
-	"aaabcbcbcdefdfefedghijghighjkllkklmmmmonono-nonppqpq-pqprsrsrstststuvuvu";
-#define TESTLENGTH (sizeof testinput - 1) /* remove the NUL */
-  saidx_t suffixarray[TESTLENGTH];
-  saidx_t lcparray[TESTLENGTH - 1];
+#undef FM_SAMPLE_RATE
+#undef FM_BLOCK_BITS
+#undef FM_PREFETCH
+#undef FM_LOCATE_BATCH
 
-  saint_t rv = suffixlcp(testinput, suffixarray, lcparray, TESTLENGTH);
-  if (rv < 0) {
-	fprintf(stderr, "suffixlcp failed: error code %d\n", rv);
-	return 70;
-  }
+/*** End of inlined file: fmindex.c ***/
 
-  for (saidx_t i = 0; i < TESTLENGTH; i++) {
-	printf("%4u%4u%4u %.4s\n", (unsigned)i, (unsigned)suffixarray[i],
-		   i == TESTLENGTH - 1 ? 0 : (unsigned)lcparray[i],
-		   testinput + suffixarray[i]);
-  }
 
-  printf("\n");
+/*** Start of inlined file: bench.c ***/
+//#include "incident.h"
 
-  struct incidence incidences[TESTLENGTH];
-  saidx_t commands = find_commands_and_incidences(
-	testinput, suffixarray, lcparray, incidences, TESTLENGTH);
+#if defined(BENCHMARK)
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* A benchmark for the parser, built instead of the interpreter with
+   -DBENCHMARK (make incident-bench). It generates synthetic programs, parses
+   each in a child process of its own, and prints a line of JSON per program
+   with the time each phase of the parse took (see struct parse_stats), the
+   throughput, and the peak resident set size of the parse.
+
+   A synthetic program is made of planted commands, each written three times,
+   with random filler before every incidence. With a nesting depth d, each
+   planted command's first two incidences enclose another planted command of
+   depth d - 1. With probability overlap, a planted command is followed by
+   another whose first incidence starts on the last octet of its third, so
+   that the two overlap and the parser deletes both.
+
+   The filler produces spurious provisional commands, as real programs do, and
+   the generator has to keep any of them from overlapping a planted command:
+   random context next to a random token is bound to occur exactly three times
+   with some prefix of it now and then. So the alphabet is split into digits,
+   six markers and filler, and the nth incidence of a command whose token is
+   the digit string w is written
+
+	 reverse(w) before[n] w reverse(w) after[n] w
+
+   where the command is w reverse(w). The markers end it on both sides, and a
+   string that reaches into it from outside either holds a whole buffer, so
+   occurs once, or occurs once for each token sharing some prefix of w. The
+   tokens are numbers of a fixed width, chosen so that no prefix is shared by
+   exactly three. Those of commands that overlap start with 0 and have no
+   other 0, so that neither of a pair occurs again where they join, and the
+   rest don't start with 0, so the commands deleted for overlapping don't
+   change the others' counts. So every planted command that isn't meant to
+   overlap should be parsed, and the JSON gives their number as "expected"
+   next to "planted"; the filler's own commands come on top. */
+
+struct bench_program {
+  saidx_t size;        /* in octets */
+  int alphabet;        /* the number of different octets used, 12 to 256 */
+  saidx_t commands;    /* commands to plant (0 for size / 256) */
+  int depth;           /* how deeply the planted commands nest */
+  double overlap;      /* the fraction of them followed by one that overlaps */
+  unsigned long seed;
+};
 
-  for (saidx_t i = 0; i < commands * 3; i++) {
-	printf("%4d%4u%4u %.*s\n", (int)(i/3), (unsigned)incidences[i].start,
-		   (unsigned)incidences[i].length, (int)incidences[i].length,
-		   testinput + incidences[i].start);
-  }
+/* The most digits a token has. */
+#define BENCH_WIDTH 64
+
+struct bench_generator {
+  const struct bench_program *program;
+  uint64_t state;      /* of the random number generator */
+  sauchar_t *output;   /* program->size octets, or NULL to only count */
+  saidx_t length;      /* written so far */
+  int digits;          /* the octets 0 to digits - 1 are digits, the next six
+						  markers, and the rest filler */
+  int width;           /* of a token, in digits */
+  saidx_t commands;    /* to plant */
+  saidx_t planted;     /* so far */
+  saidx_t owed;        /* incidences of planted commands not yet written */
+  saidx_t filler;      /* the mean length of the filler before an incidence */
+  uint64_t next[2];    /* the next token for a command that doesn't or does
+						  overlap */
+};
 
-  printf("\n");
+/* xorshift64* */
+static uint64_t
+bench_random(struct bench_generator *g)
+{
+  g->state ^= g->state >> 12;
+  g->state ^= g->state << 25;
+  g->state ^= g->state >> 27;
+  return g->state * UINT64_C(2685821657736338717);
+}
 
-  saidx_t parsed[TESTLENGTH];
-  rv = lexical_parse(testinput, parsed, TESTLENGTH);
-  if (rv < 0) {
-	fprintf(stderr, "lexical_parse failed: error code %d\n", rv);
-	return 70;
-  }
+/* Writes the nth octet of the program's alphabet: printable characters, if
+   there are few enough of them, else the lowest octets. */
+static void
+bench_put(struct bench_generator *g, int octet)
+{
+  if (g->output)
+	g->output[g->length] = g->program->alphabet <= 95 ? ' ' + octet : octet;
+  g->length++;
+}
 
-  for (unsigned i = 0; i < TESTLENGTH; i++) {
-	printf("%4u %c%4u\n", i, testinput[i], (unsigned)parsed[i]);
-  }
+/* Writes a random octet of filler. */
+static void
+bench_filler(struct bench_generator *g)
+{
+  int filler = g->program->alphabet - g->digits - 6;
+  bench_put(g, g->digits + 6 + (bench_random(g) >> 32) % filler);
+}
 
-  printf("\n");
+/* Returns the nth token for a command that overlaps: 0, then digits from 1
+   up. */
+static uint64_t
+bench_overlapping(const struct bench_generator *g, uint64_t n)
+{
+  uint64_t token = 0;
+  uint64_t place = 1;
+  for (int i = 1; i < g->width; i++, place *= g->digits, n /= g->digits - 1)
+	token += (n % (g->digits - 1) + 1) * place;
+  return token;
+}
 
-  return 0;
+/* Writes a token's digits, most significant first, or in reverse. */
+static void
+bench_token(struct bench_generator *g, uint64_t token, bool reverse)
+{
+  int digits[BENCH_WIDTH];
+  for (int i = g->width; i-- > 0; token /= g->digits)
+	digits[i] = token % g->digits;
+  for (int i = 0; i < g->width; i++)
+	bench_put(g, digits[reverse ? g->width - 1 - i : i]);
 }
-#endif
 
-/*** End of inlined file: parse.c ***/
+/* Writes the nth incidence of a command, after random filler from one octet
+   to about twice the mean length; as much as the incidences still to write
+   leave room for. If joined, the incidence starts on the last octet written
+   instead, which must be the token's first digit, 0. If open, it ends with
+   the command, for the next one to join. */
+static void
+bench_incidence(struct bench_generator *g, uint64_t token, int n, bool joined,
+				bool open)
+{
+  saidx_t incidence = 4 * g->width + 2;
+  saidx_t incidences = 3 * (g->commands - g->planted) + g->owed--;
+  saidx_t room = g->program->size - g->length - incidences * (incidence + 1);
+  saidx_t filler = 2 * (g->filler - 1);
+  if (filler > room)
+	filler = room;
+  if (joined) {
+	g->length--;
+  } else {
+	for (saidx_t i = bench_random(g) % (filler + 1) + 1; i > 0; i--)
+	  bench_filler(g);
+	bench_token(g, token, true);
+	bench_put(g, g->digits + n);
+  }
+  bench_token(g, token, false);
+  bench_token(g, token, true);
+  if (!open) {
+	bench_put(g, g->digits + 3 + n);
+	bench_token(g, token, false);
+  }
+}
 
+/* Plants a command, with a group of depth - 1 nested between its first two
+   incidences, and maybe one that overlaps it after. Returns false once all
+   the commands have been planted. */
+static bool
+bench_group(struct bench_generator *g, int depth)
+{
+  if (g->planted == g->commands)
+	return false;
+  bool overlap = g->commands - g->planted >= 2 && g->program->overlap > 0 &&
+	(bench_random(g) >> 11) * 0x1p-53 < g->program->overlap;
+  uint64_t token = overlap ? bench_overlapping(g, g->next[true]++) :
+	g->next[false]++;
+  g->planted += 1 + overlap;
+  g->owed += 3 + 3 * overlap;
+  bench_incidence(g, token, 0, false, false);
+  if (depth > 1)
+	bench_group(g, depth - 1);
+  bench_incidence(g, token, 1, false, false);
+  bench_incidence(g, token, 2, false, overlap);
+  if (overlap) {
+	token = bench_overlapping(g, g->next[true]++);
+	for (int n = 0; n < 3; n++)
+	  bench_incidence(g, token, n, n == 0, false);
+  }
+  return true;
+}
 
-/*** Start of inlined file: utils.c ***/
-//#include "incident.h"
+/* Returns true if no prefix is shared by exactly three of the count tokens
+   from first on. */
+static bool
+bench_tokens_ok(const struct bench_generator *g, uint64_t first, uint64_t count)
+{
+  if (!count)
+	return true;
+  uint64_t last = first + count - 1;
+  uint64_t block = 1;
+  for (int i = 1; i < g->width; i++) {
+	block *= g->digits;
+	/* Tokens sharing all but the last i digits. Only the blocks at either
+	   end can be partly used, since a whole one holds digits ** i. */
+	uint64_t head = first / block == last / block ? count :
+	  block - first % block;
+	uint64_t tail = first / block == last / block ? 0 : last % block + 1;
+	if (head == 3 || tail == 3)
+	  return false;
+  }
+  return true;
+}
 
-#include <stdio.h>
-#include <stdlib.h>
+/* Plants the commands, and fills the rest of the program. */
+static void
+bench_plant(struct bench_generator *g, int depth)
+{
+  while (bench_group(g, depth));
+  while (g->length < g->program->size)
+	bench_filler(g);
+}
 
-/* length is an out parameter in which the file's length is stored;
-   NULL filename slurps standard input; on error, prints an error
-   message to standard error and returns NULL, with an error code in
-   *length; otherwise, returns a malloc'ed array holding the file's
-   contents */
-sauchar_t *
-malloc_slurp_file(const char *filename, saidx_t *length)
+/* Generates a program into output. Returns the number of commands planted,
+   and sets expected to the number not meant to overlap. */
+static saidx_t
+bench_generate(const struct bench_program *program, sauchar_t *output,
+			   saidx_t *expected)
 {
-  FILE *infile = stdin;
-  if (filename) {
-	if (!((infile = fopen(filename, "rb")))) {
-	  perror(filename);
-	  *length = 66;
-	  return NULL;
+  struct bench_generator g = {program, program->seed * 2 + 1};
+  for (int i = 0; i < 8; i++)
+	bench_random(&g);
+
+  /* Two octets of filler and the rest digits. There are at least four: with
+	 three, three tokens would share every prefix but the last digit, and the
+	 tokens of commands that overlap need two digits besides 0. Filler of more
+	 octets has fewer provisional commands overlapping each other, and leaves
+	 more as commands of their own. */
+  g.digits = program->alphabet - 8;
+  g.commands = program->commands ? program->commands : program->size / 256;
+
+  /* Wide enough for twice the commands after a 0, leaving room to move the
+	 tokens of those that don't overlap, and for all of them after a 0 without
+	 another. */
+  g.width = 1;
+  for (double tokens = 1, overlapping = 1;
+	   tokens < 2.0 * g.commands + g.digits || overlapping < g.commands;
+	   tokens *= g.digits, overlapping *= g.digits - 1)
+	g.width++;
+  saidx_t incidence = 4 * g.width + 2;
+  if (g.commands > program->size / (3 * (incidence + 1)))
+	g.commands = program->size / (3 * (incidence + 1));
+  if (g.commands)
+	g.filler = (program->size - 3 * g.commands * incidence) / (3 * g.commands);
+
+  /* Count the commands that overlap and those that don't, to choose tokens
+	 for the latter, then plant them for real with the same random numbers. */
+  struct bench_generator count = g;
+  bench_plant(&count, program->depth);
+  uint64_t block = 1;
+  for (int i = 1; i < g.width; i++)
+	block *= g.digits;
+  g.next[false] = block;
+  while (!bench_tokens_ok(&g, g.next[false], count.next[false]) &&
+		 g.next[false] + count.next[false] < block * g.digits)
+	g.next[false]++;
+  g.output = output;
+  bench_plant(&g, program->depth);
+  *expected = g.planted - g.next[true];
+  return g.planted;
+}
+
+/* Parses a size-octet program in a child process, and prints its line of
+   JSON. Returns 0 on success, or an exit status. */
+static int
+bench_run(struct bench_program program, const struct parse_options *options)
+{
+  fflush(stdout);
+  pid_t child = fork();
+  if (child < 0) {
+	perror("fork");
+	return 71;
+  }
+  if (child > 0) {
+	int status;
+	if (waitpid(child, &status, 0) < 0) {
+	  perror("waitpid");
+	  return 71;
 	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 70;
   }
 
-  /* Now slurp the input. */
-  saidx_t inputalloc = 0;
-  saidx_t inputlen = 0;
-  sauchar_t *input = 0;
-  for (;;) {
-	int c = getc(infile);
-	if (c == EOF) {
-	  if (feof(infile)) {
-		break;
-	  } else { /* ferror(infile) */
-		perror("reading input file");
-		free(input);
-		if (infile != stdin)
-		  fclose(infile);
-		*length = 66;
-		return NULL;
-	  }
-	}
+  sauchar_t *input = malloc(program.size);
+  saidx_t *parsed = malloc(program.size * sizeof *parsed);
+  saidx_t expected;
+  saidx_t planted = input && parsed ?
+	bench_generate(&program, input, &expected) : -1;
+  if (planted < 0) {
+	fprintf(stderr, "Out of memory generating a %" PRIdSAIDX_T
+			"-octet program\n", program.size);
+	_exit(71);
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  long before = usage.ru_maxrss;
+
+  struct parse_stats stats;
+  struct parse_options parse = *options;
+  parse.stats = &stats;
+  double start = parse_clock();
+  saidx_t commands = lexical_parse(input, parsed, program.size, &parse);
+  double total = parse_clock() - start;
+  if (commands < 0) {
+	fprintf(stderr, "Parse of a %" PRIdSAIDX_T "-octet program failed: "
+			"error code %" PRIdSAIDX_T "\n", program.size, commands);
+	_exit(commands == -2 ? 71 : 70);
+  }
+  getrusage(RUSAGE_SELF, &usage);
+
+  /* ru_maxrss is in kilobytes on Linux. parsed isn't touched before the
+	 parse, so what the parse added to the peak includes it. */
+  long peak = usage.ru_maxrss - before;
+  static const char *const engines[] = {"divsufsort", "sais", "bwt"};
+  printf("{\"size\": %" PRIdSAIDX_T ", \"alphabet\": %d, \"depth\": %d, "
+		 "\"overlap\": %g, \"seed\": %lu, \"engine\": \"%s\", "
+		 "\"lcp\": \"%s\", \"planted\": %" PRIdSAIDX_T ", "
+		 "\"expected\": %" PRIdSAIDX_T ", \"provisional\": %" PRIdSAIDX_T ", "
+		 "\"commands\": %" PRIdSAIDX_T ", "
+		 "\"sort_s\": %.6f, \"lcp_s\": %.6f, \"scan_s\": %.6f, "
+		 "\"resolve_s\": %.6f, \"relabel_s\": %.6f, \"total_s\": %.6f, "
+		 "\"mb_per_s\": %.3f, \"peak_rss_kib\": %ld, "
+		 "\"parse_rss_kib\": %ld, \"octets_per_octet\": %.3f}\n",
+		 program.size, program.alphabet, program.depth, program.overlap,
+		 program.seed, engines[options->engine],
+		 lcp_uses_kasai(options) ? "kasai" : "phi",
+		 planted, expected, stats.provisional, commands, stats.sort, stats.lcp,
+		 stats.scan, stats.resolve, stats.relabel, total,
+		 total > 0 ? program.size / total / 1e6 : 0, usage.ru_maxrss, peak,
+		 peak * 1024.0 / program.size);
+  fflush(stdout);
+  _exit(0);
+}
 
-	if (inputlen == inputalloc) {
-	  inputalloc += 8;
-	  inputalloc *= 16;
-	  sauchar_t *newinput = realloc(input, inputalloc);
-	  if (!newinput) {
-		perror("allocating memory");
-		*length = 71;
-		if (infile != stdin)
-		  fclose(infile);
-		free(input);
-		return NULL;
-	  } else {
-		input = newinput;
+/* Parses a size with an optional k, M or G suffix. Returns 0 if invalid. */
+static saidx_t
+bench_size(const char *text, char **end)
+{
+  double size = strtod(text, end);
+  switch (**end) {
+  case 'G':
+	size *= 1024;
+	/* fall through */
+  case 'M':
+	size *= 1024;
+	/* fall through */
+  case 'k':
+	size *= 1024;
+	++*end;
+  }
+  return size >= 1 && size <= SAIDX_MAX ? (saidx_t)size : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_program program = {0, 16, 0, 1, 0.1, 1};
+  struct parse_options parse_options = {0};
+  const char *sizes = "1k,1M,16M";
+  char *end;
+
+  for (; argc > 1; argc--, argv++) {
+	const char *arg = argv[1];
+	if (!strncmp(arg, "--size=", 7)) {
+	  sizes = arg + 7;
+	} else if (!strncmp(arg, "--alphabet=", 11)) {
+	  long alphabet = strtol(arg + 11, &end, 10);
+	  if (*end || alphabet < 12 || alphabet > 256)
+		goto usage;
+	  program.alphabet = alphabet;
+	} else if (!strncmp(arg, "--commands=", 11)) {
+	  program.commands = bench_size(arg + 11, &end);
+	  if (*end || !program.commands)
+		goto usage;
+	} else if (!strncmp(arg, "--depth=", 8)) {
+	  long depth = strtol(arg + 8, &end, 10);
+	  if (*end || depth < 1 || depth > 1000)
+		goto usage;
+	  program.depth = depth;
+	} else if (!strncmp(arg, "--overlap=", 10)) {
+	  program.overlap = strtod(arg + 10, &end);
+	  if (*end || !(program.overlap >= 0 && program.overlap <= 1))
+		goto usage;
+	} else if (!strncmp(arg, "--seed=", 7)) {
+	  program.seed = strtoul(arg + 7, &end, 10);
+	  if (*end)
+		goto usage;
+	} else if (!strcmp(arg, "--engine=divsufsort")) {
+	  parse_options.engine = ENGINE_DIVSUFSORT;
+	} else if (!strcmp(arg, "--engine=sais")) {
+	  parse_options.engine = ENGINE_SAIS;
+	} else if (!strcmp(arg, "--engine=bwt")) {
+	  parse_options.engine = ENGINE_BWT;
+	} else if (!strcmp(arg, "--lcp=phi")) {
+	  parse_options.lcp = LCP_PHI;
+	} else if (!strcmp(arg, "--lcp=kasai")) {
+	  parse_options.lcp = LCP_KASAI;
+	} else if (!strncmp(arg, "-j", 2)) {
+	  const char *count = arg[2] ? arg + 2 : argc > 2 ? argv[2] : "";
+	  long threads = strtol(count, &end, 10);
+	  if (!*count || *end || threads < 1 || threads > 4096)
+		goto usage;
+	  parse_options.threads = threads;
+	  if (!arg[2]) {
+		argc--;
+		argv++;
 	  }
+	} else {
+	  goto usage;
 	}
+  }
 
-	input[inputlen++] = (sauchar_t)c;
+  /* Check all the sizes before running any. */
+  for (const char *size = sizes;; size = end + 1) {
+	if (!bench_size(size, &end) || (*end && *end != ','))
+	  goto usage;
+	if (!*end)
+	  break;
+  }
+  int status = 0;
+  for (const char *size = sizes;; size = end + 1) {
+	program.size = bench_size(size, &end);
+	int rv = bench_run(program, &parse_options);
+	if (rv)
+	  status = rv;
+	if (!*end)
+	  return status;
   }
 
-  *length = inputlen;
-  if (infile != stdin)
-	fclose(infile);
-  return input;
+usage:
+  fputs("Usage: incident-bench [options]\n", stderr);
+  fputs("Parses synthetic programs, printing a line of JSON for each.\n",
+		stderr);
+  fputs("  --size=N[k|M|G][,...]  Program sizes (default 1k,1M,16M)\n",
+		stderr);
+  fputs("  --alphabet=N  Octets used, 12 to 256 (default 16)\n", stderr);
+  fputs("  --commands=N[k|M|G]  Commands to plant (default size/256)\n",
+		stderr);
+  fputs("  --depth=N  Nesting depth of planted commands (default 1)\n",
+		stderr);
+  fputs("  --overlap=F  Fraction of planted commands overlapped by the next "
+		"(default 0.1)\n", stderr);
+  fputs("  --seed=N  Random seed (default 1)\n", stderr);
+  fputs("  --engine=divsufsort|sais|bwt, --lcp=phi|kasai, -j N  As for "
+		"incident\n", stderr);
+  return 64;
 }
 
-/*** End of inlined file: utils.c ***/
+#endif /* BENCHMARK */
+
+/*** End of inlined file: bench.c ***/
 
 
 /*** Start of inlined file: mydivsufsort2.c ***/
@@ -1009,7 +5954,7 @@ extern "C" {
 # endif
 #endif
 #if defined(BUILD_DIVSUFSORT64)
-# include "divsufsort64.h"
+//# include "divsufsort64.h"
 # ifndef SAIDX_T
 #  define SAIDX_T
 #  define saidx_t saidx64_t
@@ -1173,6 +6118,7 @@ sort_typeBstar(const sauchar_t *T, saidx_t *SA,
 #ifdef _OPENMP
   saidx_t *curbuf;
   saidx_t l;
+  saidx_t w;
 #endif
   saidx_t i, j, k, t, m, bufsize;
   saint_t c0, c1;
@@ -1232,30 +6178,23 @@ note:
 
 	/* Sort the type B* substrings using sssort. */
 #ifdef _OPENMP
+	/* The buckets are handed out by the loop schedule (an atomic counter)
+	   rather than from inside a critical section, so that threads don't queue
+	   up behind one another when there are many of them. Each work item is
+	   one (c0, c1) pair; the bucket for a pair runs up to the start of the
+	   next pair's bucket. */
 	tmp = omp_get_max_threads();
 	buf = SA + m, bufsize = (n - (2 * m)) / tmp;
-	c0 = ALPHABET_SIZE - 2, c1 = ALPHABET_SIZE - 1, j = m;
-#pragma omp parallel default(shared) private(curbuf, k, l, d0, d1, tmp)
-	{
-	  tmp = omp_get_thread_num();
-	  curbuf = buf + tmp * bufsize;
-	  k = 0;
-	  for(;;) {
-		#pragma omp critical(sssort_lock)
-		{
-		  if(0 < (l = j)) {
-			d0 = c0, d1 = c1;
-			do {
-			  k = BUCKET_BSTAR(d0, d1);
-			  if(--d1 <= d0) {
-				d1 = ALPHABET_SIZE - 1;
-				if(--d0 < 0) { break; }
-			  }
-			} while(((l - k) <= 1) && (0 < (l = k)));
-			c0 = d0, c1 = d1, j = k;
-		  }
-		}
-		if(l == 0) { break; }
+#pragma omp parallel for default(shared) private(curbuf, k, l, d0, d1) \
+  schedule(dynamic, 1)
+	for(w = 0; w < BUCKET_B_SIZE; ++w) {
+	  d0 = (saint_t)(w / ALPHABET_SIZE), d1 = (saint_t)(w % ALPHABET_SIZE);
+	  if(d1 <= d0) { continue; }
+	  k = BUCKET_BSTAR(d0, d1);
+	  l = (d1 + 1 < ALPHABET_SIZE) ? BUCKET_BSTAR(d0, d1 + 1) :
+		  (d0 + 2 < ALPHABET_SIZE) ? BUCKET_BSTAR(d0 + 1, d0 + 2) : m;
+	  if(1 < (l - k)) {
+		curbuf = buf + omp_get_thread_num() * bufsize;
 		sssort(T, PAb, SA + k, SA + l,
 			   curbuf, bufsize, 2, n, *(SA + k) == (m - 1));
 	  }